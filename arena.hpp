@@ -0,0 +1,195 @@
+/*
+ * arena.hpp                -- block allocation of expression nodes
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARENA_HPP_2026_10_18__
+#define __ARENA_HPP_2026_10_18__
+
+#include <cstddef>
+#include <new>
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#endif
+
+namespace NRaingee
+{
+    // Single block which objects are laid out in one after another in order
+    // of allocation. The block is freed when its owner and all the objects
+    // allocated from it are gone. Arena of zero size only counts bytes
+    // requested, while objects are allocated from heap.
+    class TArena
+    {
+        // Each object is prefixed with arena it came from, null stands for
+        // heap
+        union THeader_
+        {
+            TArena* Arena_;
+            long double Align_;
+        };
+
+        char* const Data_;
+        const std::size_t Size_;
+        std::size_t Used_;
+#if __cplusplus >= 201103L
+        std::atomic<unsigned> Counter_;
+#else
+        unsigned Counter_;
+#endif
+
+        TArena(const TArena&);
+        TArena& operator =(const TArena&);
+
+        inline ~TArena()
+        {
+            delete[] Data_;
+        }
+
+    public:
+        inline explicit TArena(std::size_t size)
+            : Data_(size ? new char[size] : 0)
+            , Size_(size)
+            , Used_(0)
+            , Counter_(1)
+        {
+        }
+
+        // Bytes requested so far, including objects which didn't fit
+        inline std::size_t GetUsed() const
+        {
+            return Used_;
+        }
+
+        // Drops owner's reference
+        inline void Release()
+        {
+            if (!--Counter_)
+            {
+                delete this;
+            }
+        }
+
+        static void* Allocate(TArena* arena, std::size_t size)
+        {
+            size = (size + sizeof(THeader_) - 1) / sizeof(THeader_)
+                * sizeof(THeader_) + sizeof(THeader_);
+            THeader_* header;
+            if (arena && arena->Used_ + size <= arena->Size_)
+            {
+                header = reinterpret_cast<THeader_*>(
+                    arena->Data_ + arena->Used_);
+                header->Arena_ = arena;
+                ++arena->Counter_;
+            }
+            else
+            {
+                header = static_cast<THeader_*>(::operator new(size));
+                header->Arena_ = 0;
+            }
+            if (arena)
+            {
+                arena->Used_ += size;
+            }
+            return header + 1;
+        }
+
+        static void Deallocate(void* ptr)
+        {
+            if (ptr)
+            {
+                THeader_* header = static_cast<THeader_*>(ptr) - 1;
+                if (header->Arena_)
+                {
+                    header->Arena_->Release();
+                }
+                else
+                {
+                    ::operator delete(header);
+                }
+            }
+        }
+    };
+
+    // Creates arena and holds reference to it while in scope. Objects
+    // allocated from the arena keep it alive after the scope ends.
+    class TArenaScope
+    {
+        TArena* const Arena_;
+
+        TArenaScope(const TArenaScope&);
+        TArenaScope& operator =(const TArenaScope&);
+
+    public:
+        inline explicit TArenaScope(std::size_t size)
+            : Arena_(new TArena(size))
+        {
+        }
+
+        inline ~TArenaScope()
+        {
+            Arena_->Release();
+        }
+
+        inline TArena& GetArena() const
+        {
+            return *Arena_;
+        }
+
+        inline std::size_t GetUsed() const
+        {
+            return Arena_->GetUsed();
+        }
+    };
+
+    // Object of TBase, which is allocated from arena. Other objects of TBase
+    // are allocated as usual and don't pay for arena header.
+    template <class TBase>
+    class TArenaAllocated: public TBase
+    {
+    public:
+        template <class TArg>
+        inline explicit TArenaAllocated(const TArg& arg)
+            : TBase(arg)
+        {
+        }
+
+        template <class TFirst, class TSecond, class TThird>
+        inline TArenaAllocated(TFirst& first, TSecond& second,
+            const TThird& third)
+            : TBase(first, second, third)
+        {
+        }
+
+        static inline void* operator new(std::size_t size, TArena& arena)
+        {
+            return TArena::Allocate(&arena, size);
+        }
+
+        static inline void operator delete(void* ptr, TArena&)
+        {
+            TArena::Deallocate(ptr);
+        }
+
+        static inline void operator delete(void* ptr)
+        {
+            TArena::Deallocate(ptr);
+        }
+    };
+}
+
+#endif
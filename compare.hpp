@@ -0,0 +1,179 @@
+/*
+ * compare.hpp              -- three-way comparison adapters
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COMPARE_HPP_2026_10_18__
+#define __COMPARE_HPP_2026_10_18__
+
+#include <functional>
+#include <limits>
+#include <string>
+
+namespace NRaingee
+{
+    // Wraps comparator which returns negative, zero or positive value when
+    // lhs is less, equal or greater than rhs respectively
+    template <class TCompare>
+    class TThreeWayCompare
+    {
+        TCompare Compare_;
+
+    public:
+        inline explicit TThreeWayCompare(const TCompare& compare)
+            : Compare_(compare)
+        {
+        }
+
+        template <class TType>
+        inline int operator ()(const TType& lhs, const TType& rhs)
+        {
+            return Compare_(lhs, rhs);
+        }
+    };
+
+    template <class TCompare>
+    static inline TThreeWayCompare<TCompare> ThreeWay(const TCompare& compare)
+    {
+        return TThreeWayCompare<TCompare>(compare);
+    }
+
+    // Calls comparator as strict weak ordering
+    template <class TCompare>
+    struct TStrictWeakOrder
+    {
+        template <class TType>
+        static inline bool Less(TCompare& compare, const TType& lhs,
+            const TType& rhs)
+        {
+            return compare(lhs, rhs);
+        }
+    };
+
+    template <class TCompare>
+    struct TStrictWeakOrder<TThreeWayCompare<TCompare> >
+    {
+        template <class TType>
+        static inline bool Less(TThreeWayCompare<TCompare>& compare,
+            const TType& lhs, const TType& rhs)
+        {
+            return compare(lhs, rhs) < 0;
+        }
+    };
+
+    // Derives three-way comparison from strict weak ordering, which requires
+    // up to two calls of comparator
+    template <class TCompare>
+    struct TStrictWeakThreeWay
+    {
+        template <class TType>
+        static inline int Compare(TCompare& compare, const TType& lhs,
+            const TType& rhs)
+        {
+            if (compare(lhs, rhs))
+            {
+                return -1;
+            }
+            else if (compare(rhs, lhs))
+            {
+                return 1;
+            }
+            else
+            {
+                return 0;
+            }
+        }
+    };
+
+    // Orders two values with a single call of comparator where possible
+    template <class TCompare>
+    struct TThreeWay: TStrictWeakThreeWay<TCompare>
+    {
+    };
+
+    template <class TCompare>
+    struct TThreeWay<TThreeWayCompare<TCompare> >
+    {
+        template <class TType>
+        static inline int Compare(TThreeWayCompare<TCompare>& compare,
+            const TType& lhs, const TType& rhs)
+        {
+            return compare(lhs, rhs);
+        }
+    };
+
+    template <class TType, bool IsArithmetic>
+    struct TLessThreeWay: TStrictWeakThreeWay<std::less<TType> >
+    {
+    };
+
+    template <class TType>
+    struct TLessThreeWay<TType, true>
+    {
+        static inline int Compare(std::less<TType>&, const TType& lhs,
+            const TType& rhs)
+        {
+            return (rhs < lhs) - (lhs < rhs);
+        }
+    };
+
+    template <class TType>
+    struct TThreeWay<std::less<TType> >
+    {
+        static inline int Compare(std::less<TType>& compare, const TType& lhs,
+            const TType& rhs)
+        {
+            return TLessThreeWay<TType,
+                std::numeric_limits<TType>::is_specialized>::Compare(
+                    compare, lhs, rhs);
+        }
+    };
+
+    template <class TChar, class TTraits, class TAllocator>
+    struct TThreeWay<
+        std::less<std::basic_string<TChar, TTraits, TAllocator> > >
+    {
+        typedef std::basic_string<TChar, TTraits, TAllocator> TString_;
+
+        static inline int Compare(std::less<TString_>&, const TString_& lhs,
+            const TString_& rhs)
+        {
+            return lhs.compare(rhs);
+        }
+    };
+
+    // Equivalence induced by ordering
+    template <class TCompare>
+    class TEquivalent
+    {
+        mutable TCompare Compare_;
+
+    public:
+        inline explicit TEquivalent(const TCompare& compare)
+            : Compare_(compare)
+        {
+        }
+
+        template <class TType>
+        inline bool operator ()(const TType& lhs, const TType& rhs) const
+        {
+            return !TThreeWay<TCompare>::Compare(Compare_, lhs, rhs);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * externalsort.hpp         -- sorting of ranges which don't fit in memory
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EXTERNALSORT_HPP_2026_10_18__
+#define __EXTERNALSORT_HPP_2026_10_18__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#endif
+
+#include "parallel.hpp"
+#include "range.hpp"
+
+namespace NRaingee
+{
+    template <bool>
+    struct TPodSerializerCheck;
+
+    template <>
+    struct TPodSerializerCheck<true>
+    {
+    };
+
+    // Stores values as raw bytes, suitable for trivially copyable types only.
+    // Without C++11 type traits only arithmetic types are accepted, others
+    // should be sorted with explicit serializer.
+    template <class TType>
+    struct TPodSerializer
+    {
+#if __cplusplus >= 201103L
+        static_assert(std::is_trivially_copyable<TType>::value,
+            "raw bytes serialization requires trivially copyable type");
+#else
+        enum
+        {
+            Checked_ = sizeof(TPodSerializerCheck<
+                std::numeric_limits<TType>::is_specialized>)
+        };
+#endif
+
+        static inline bool Write(std::FILE* file, const TType& value)
+        {
+            return std::fwrite(&value, sizeof(TType), 1, file) == 1;
+        }
+
+        static inline bool Read(std::FILE* file, TType& value)
+        {
+            return std::fread(&value, sizeof(TType), 1, file) == 1;
+        }
+    };
+
+    // Lazy k-way merge of sorted runs kept in temporary files. Read buffers
+    // of all merged runs fit in the memory budget, so if there are too many
+    // runs, they are merged in several passes first. Copies share the files.
+    template <class TType, class TCompare, class TSerializer>
+    class TMergedRunsImpl: public IRangeImpl<TType>
+    {
+        static const std::size_t MaxBlockSize_ = 1024;
+        // Limits number of simultaneously open files
+        static const std::size_t MaxFanIn_ = 64;
+
+        struct TRun_
+        {
+            std::FILE* File_;
+            std::fpos_t Start_;
+            std::size_t Size_;
+        };
+
+        // Runs which are merged already are closed, the rest of them are
+        // live
+        class TSharedRuns_
+        {
+            std::vector<TRun_> Runs_;
+            std::size_t First_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+            // Copies of the range read the same files
+            std::mutex Mutex_;
+#else
+            unsigned Counter_;
+#endif
+
+            TSharedRuns_(const TSharedRuns_&);
+            TSharedRuns_& operator =(const TSharedRuns_&);
+
+        public:
+            inline TSharedRuns_()
+                : First_(0)
+                , Counter_(1)
+            {
+            }
+
+            inline ~TSharedRuns_()
+            {
+                Drop(First_, Runs_.size());
+            }
+
+            inline void IncreaseCounter()
+            {
+                ++Counter_;
+            }
+
+            inline unsigned DecreaseCounter()
+            {
+                return --Counter_;
+            }
+
+            inline std::size_t Begin() const
+            {
+                return First_;
+            }
+
+            inline std::size_t End() const
+            {
+                return Runs_.size();
+            }
+
+            inline const TRun_& GetRun(std::size_t run) const
+            {
+                return Runs_[run];
+            }
+
+            // Starts new run, values are appended to it with Write()
+            void Open()
+            {
+                TRun_ run = TRun_();
+                run.File_ = std::tmpfile();
+                if (!run.File_)
+                {
+                    throw std::runtime_error(
+                        "can't create temporary file for external sort");
+                }
+
+                if (std::fgetpos(run.File_, &run.Start_))
+                {
+                    std::fclose(run.File_);
+                    throw std::runtime_error(
+                        "can't get position in temporary file");
+                }
+                Runs_.push_back(run);
+            }
+
+            void Write(const TType& value)
+            {
+                TRun_& run = Runs_.back();
+                if (!TSerializer::Write(run.File_, value))
+                {
+                    throw std::runtime_error(
+                        "can't write to temporary file");
+                }
+                ++run.Size_;
+            }
+
+            // Closes runs, which are merged into other runs
+            void Drop(std::size_t first, std::size_t last)
+            {
+                for (std::size_t i = first; i < last; ++i)
+                {
+                    std::fclose(Runs_[i].File_);
+                }
+
+                if (first == First_)
+                {
+                    First_ = last;
+                }
+            }
+
+            // Reads count values starting at offset
+            void Read(std::size_t run, std::fpos_t& offset, std::size_t count,
+                std::vector<TType>& buffer)
+            {
+#if __cplusplus >= 201103L
+                std::lock_guard<std::mutex> guard(Mutex_);
+#endif
+                std::FILE* file = Runs_[run].File_;
+                bool success = !std::fsetpos(file, &offset);
+                TType value;
+                for (; success && count; --count)
+                {
+                    success = TSerializer::Read(file, value);
+                    if (success)
+                    {
+                        buffer.push_back(value);
+                    }
+                }
+
+                if (!success || std::fgetpos(file, &offset))
+                {
+                    throw std::runtime_error(
+                        "can't read from temporary file");
+                }
+            }
+        };
+
+        struct TCursor_
+        {
+            std::vector<TType> Buffer_;
+            std::size_t Position_;
+            std::size_t Run_;
+            std::fpos_t Offset_;
+            std::size_t Remaining_;
+        };
+
+        class THeapCompare_
+        {
+            const std::vector<TCursor_>* Cursors_;
+            TCompare* Compare_;
+
+        public:
+            inline THeapCompare_(const std::vector<TCursor_>& cursors,
+                TCompare& compare)
+                : Cursors_(&cursors)
+                , Compare_(&compare)
+            {
+            }
+
+            inline bool operator ()(std::size_t lhs, std::size_t rhs) const
+            {
+                const TCursor_& first = (*Cursors_)[lhs];
+                const TCursor_& second = (*Cursors_)[rhs];
+                return (*Compare_)(second.Buffer_[second.Position_],
+                    first.Buffer_[first.Position_]);
+            }
+        };
+
+        TSharedRuns_* const Runs_;
+        std::vector<TCursor_> Cursors_;
+        // Min-heap of non-empty cursors
+        std::vector<std::size_t> Heap_;
+        TCompare Compare_;
+        std::size_t BlockSize_;
+
+        void Refill(std::size_t index)
+        {
+            TCursor_& cursor = Cursors_[index];
+            cursor.Buffer_.clear();
+            cursor.Position_ = 0;
+            const std::size_t count = std::min(BlockSize_, cursor.Remaining_);
+            Runs_->Read(cursor.Run_, cursor.Offset_, count, cursor.Buffer_);
+            cursor.Remaining_ -= count;
+        }
+
+        void Start(std::size_t first, std::size_t last)
+        {
+            Cursors_.resize(last - first);
+            for (std::size_t i = 0; i < Cursors_.size(); ++i)
+            {
+                const TRun_& run = Runs_->GetRun(first + i);
+                Cursors_[i].Run_ = first + i;
+                Cursors_[i].Offset_ = run.Start_;
+                Cursors_[i].Remaining_ = run.Size_;
+                Refill(i);
+                if (!Cursors_[i].Buffer_.empty())
+                {
+                    Heap_.push_back(i);
+                }
+            }
+            std::make_heap(Heap_.begin(), Heap_.end(),
+                THeapCompare_(Cursors_, Compare_));
+        }
+
+        // Merges runs from first to last into new run
+        void Merge(std::size_t first, std::size_t last)
+        {
+            TMergedRunsImpl merged(Runs_, Compare_, BlockSize_);
+            merged.Start(first, last);
+            Runs_->Open();
+            for (; !merged.IsEmpty(); merged.Pop())
+            {
+                Runs_->Write(merged.Front());
+            }
+            Runs_->Drop(first, last);
+        }
+
+        inline TMergedRunsImpl(TSharedRuns_* runs, TCompare compare,
+            std::size_t blockSize)
+            : Runs_(runs)
+            , Compare_(compare)
+            , BlockSize_(blockSize)
+        {
+            Runs_->IncreaseCounter();
+        }
+
+        inline TMergedRunsImpl(const TMergedRunsImpl* range)
+            : Runs_(range->Runs_)
+            , Cursors_(range->Cursors_)
+            , Heap_(range->Heap_)
+            , Compare_(range->Compare_)
+            , BlockSize_(range->BlockSize_)
+        {
+            Runs_->IncreaseCounter();
+        }
+
+    public:
+        // Sorts run, which holds first values of input, and the rest of the
+        // input in runs of the same size, which is the memory budget
+        template <class TAssert>
+        TMergedRunsImpl(std::vector<TType>& run, TRange<TType, TAssert>& range,
+            TCompare compare)
+            : Runs_(new TSharedRuns_)
+            , Compare_(compare)
+        {
+            const std::size_t runSize = run.size();
+            BlockSize_ = std::max<std::size_t>(
+                std::min(runSize / MaxFanIn_, MaxBlockSize_), 1);
+            const std::size_t fanIn = std::min(
+                std::max<std::size_t>(runSize / BlockSize_, 2), MaxFanIn_);
+            try
+            {
+                while (!run.empty())
+                {
+                    ParallelSort(run.begin(), run.end(), Compare_,
+                        HardwareThreads());
+                    Runs_->Open();
+                    for (std::size_t i = 0; i < run.size(); ++i)
+                    {
+                        Runs_->Write(run[i]);
+                    }
+                    run.clear();
+                    for (; !range.IsEmpty() && run.size() < runSize;
+                        range.Pop())
+                    {
+                        run.push_back(range.Front());
+                    }
+                }
+
+                while (Runs_->End() - Runs_->Begin() > fanIn)
+                {
+                    const std::size_t end = Runs_->End();
+                    while (Runs_->Begin() < end)
+                    {
+                        const std::size_t first = Runs_->Begin();
+                        Merge(first, std::min(first + fanIn, end));
+                    }
+                }
+                Start(Runs_->Begin(), Runs_->End());
+            }
+            catch (...)
+            {
+                delete Runs_;
+                throw;
+            }
+        }
+
+        inline ~TMergedRunsImpl()
+        {
+            if (!Runs_->DecreaseCounter())
+            {
+                delete Runs_;
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Heap_.empty();
+        }
+
+        void Pop()
+        {
+            const THeapCompare_ compare(Cursors_, Compare_);
+            std::pop_heap(Heap_.begin(), Heap_.end(), compare);
+            const std::size_t index = Heap_.back();
+            TCursor_& cursor = Cursors_[index];
+            if (++cursor.Position_ == cursor.Buffer_.size())
+            {
+                Refill(index);
+            }
+
+            if (cursor.Buffer_.empty())
+            {
+                Heap_.pop_back();
+            }
+            else
+            {
+                std::push_heap(Heap_.begin(), Heap_.end(), compare);
+            }
+        }
+
+        inline TType Front() const
+        {
+            const TCursor_& cursor = Cursors_[Heap_.front()];
+            return cursor.Buffer_[cursor.Position_];
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TMergedRunsImpl(this);
+        }
+
+        bool EstimateSize(std::size_t& size) const
+        {
+            size = 0;
+            for (std::size_t i = 0; i < Heap_.size(); ++i)
+            {
+                const TCursor_& cursor = Cursors_[Heap_[i]];
+                size += cursor.Buffer_.size() - cursor.Position_
+                    + cursor.Remaining_;
+            }
+            return true;
+        }
+    };
+
+    template <class TType, class TCompare, class TSerializer>
+    const std::size_t
+        TMergedRunsImpl<TType, TCompare, TSerializer>::MaxBlockSize_;
+
+    template <class TType, class TCompare, class TSerializer>
+    const std::size_t
+        TMergedRunsImpl<TType, TCompare, TSerializer>::MaxFanIn_;
+
+    // Sorts range using at most memoryBudget bytes for buffered values,
+    // values beyond the budget are spilled to temporary files in sorted runs.
+    // Throws std::runtime_error if temporary files can't be used.
+    template <class TType, class TAssert, class TCompare, class TSerializer>
+    static inline TRange<TType, TAssert> Sort(TRange<TType, TAssert> range,
+        TCompare compare, std::size_t memoryBudget, TSerializer)
+    {
+        const std::size_t runSize =
+            std::max<std::size_t>(memoryBudget / sizeof(TType), 1);
+        std::vector<TType> run;
+        for (; !range.IsEmpty() && run.size() < runSize; range.Pop())
+        {
+            run.push_back(range.Front());
+        }
+
+        if (range.IsEmpty())
+        {
+            ParallelSort(run.begin(), run.end(), compare, HardwareThreads());
+            return TRange<TType, TAssert>(run.empty() ?
+                0 : TSequenceRangeImpl<TType>::Adopt(run));
+        }
+        else
+        {
+            return TRange<TType, TAssert>(
+                new TMergedRunsImpl<TType, TCompare, TSerializer>(run, range,
+                    compare));
+        }
+    }
+
+    template <class TType, class TAssert, class TCompare>
+    static inline TRange<TType, TAssert> Sort(TRange<TType, TAssert> range,
+        TCompare compare, std::size_t memoryBudget = 1 << 26)
+    {
+        return Sort(Move(range), compare, memoryBudget,
+            TPodSerializer<TType>());
+    }
+
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Sort(TRange<TType, TAssert> range)
+    {
+        return Sort(Move(range), std::less<TType>());
+    }
+}
+
+#endif
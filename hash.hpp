@@ -0,0 +1,211 @@
+/*
+ * hash.hpp                 -- hash functions and open addressing hash set
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HASH_HPP_2026_10_18__
+#define __HASH_HPP_2026_10_18__
+
+#include <cstddef>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NRaingee
+{
+    typedef unsigned long long TFingerprint;
+
+    static inline TFingerprint MixFingerprint(TFingerprint value)
+    {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdULL;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ULL;
+        value ^= value >> 33;
+        return value;
+    }
+
+    static inline TFingerprint CombineFingerprints(TFingerprint lhs,
+        TFingerprint rhs)
+    {
+        return lhs && rhs ? MixFingerprint(lhs * 0x9e3779b97f4a7c15ULL + rhs)
+            : 0;
+    }
+
+    static inline TFingerprint AddressFingerprint(const void* address)
+    {
+        return MixFingerprint(reinterpret_cast<std::size_t>(address)) | 1;
+    }
+
+    template <class TType, bool IsInteger>
+    struct TIntegerHash;
+
+    template <class TType>
+    struct TIntegerHash<TType, true>
+    {
+        inline TFingerprint operator ()(TType value) const
+        {
+            return MixFingerprint(static_cast<TFingerprint>(value));
+        }
+    };
+
+    // Hash function for integer types, strings and pairs of them
+    template <class TType>
+    struct THash: TIntegerHash<TType, std::numeric_limits<TType>::is_integer>
+    {
+    };
+
+    template <class TChar, class TTraits, class TAllocator>
+    struct THash<std::basic_string<TChar, TTraits, TAllocator> >
+    {
+        TFingerprint operator ()(
+            const std::basic_string<TChar, TTraits, TAllocator>& value) const
+        {
+            TFingerprint result = 0xcbf29ce484222325ULL;
+            for (std::size_t i = 0; i < value.size(); ++i)
+            {
+                result ^= static_cast<TFingerprint>(value[i]);
+                result *= 0x100000001b3ULL;
+            }
+            return MixFingerprint(result);
+        }
+    };
+
+    template <class TFirst, class TSecond>
+    struct THash<std::pair<TFirst, TSecond> >
+    {
+        inline TFingerprint operator ()(
+            const std::pair<TFirst, TSecond>& value) const
+        {
+            return MixFingerprint(THash<TFirst>()(value.first)
+                * 0x9e3779b97f4a7c15ULL + THash<TSecond>()(value.second));
+        }
+    };
+
+    // Set with linear probing, kept at most half full
+    template <class TType, class THashFunc, class TEqual>
+    class THashSet
+    {
+        std::vector<TType> Slots_;
+        std::vector<bool> Used_;
+        std::size_t Size_;
+        THashFunc Hash_;
+        TEqual Equal_;
+
+        inline std::size_t Find(const TType& value) const
+        {
+            const std::size_t mask = Slots_.size() - 1;
+            std::size_t pos = static_cast<std::size_t>(Hash_(value)) & mask;
+            while (Used_[pos] && !Equal_(Slots_[pos], value))
+            {
+                pos = (pos + 1) & mask;
+            }
+            return pos;
+        }
+
+        void Grow()
+        {
+            THashSet result(Hash_, Equal_);
+            result.Slots_.resize(Slots_.empty() ? 16 : Slots_.size() * 2);
+            result.Used_.resize(result.Slots_.size());
+            for (std::size_t i = 0; i < Slots_.size(); ++i)
+            {
+                if (Used_[i])
+                {
+                    result.Insert(Slots_[i]);
+                }
+            }
+            Swap(result);
+        }
+
+    public:
+        inline THashSet(THashFunc hash, TEqual equal)
+            : Size_(0)
+            , Hash_(hash)
+            , Equal_(equal)
+        {
+        }
+
+        inline std::size_t Size() const
+        {
+            return Size_;
+        }
+
+        inline bool NeedsGrow() const
+        {
+            return (Size_ + 1) * 2 > Slots_.size();
+        }
+
+        inline std::size_t GetMemoryUsage() const
+        {
+            return Slots_.size() * sizeof(TType) + Used_.size() / 8;
+        }
+
+        inline bool Contains(const TType& value) const
+        {
+            return Size_ && Used_[Find(value)];
+        }
+
+        // Returns false if equal value is already in set
+        bool Insert(const TType& value)
+        {
+            if (NeedsGrow())
+            {
+                Grow();
+            }
+            const std::size_t pos = Find(value);
+            if (Used_[pos])
+            {
+                return false;
+            }
+            Slots_[pos] = value;
+            Used_[pos] = true;
+            ++Size_;
+            return true;
+        }
+
+        // Removes all values, but keeps allocated memory
+        inline void Clear()
+        {
+            Used_.assign(Used_.size(), false);
+            Size_ = 0;
+        }
+
+        template <class TOutputIterator>
+        TOutputIterator CopyTo(TOutputIterator out) const
+        {
+            for (std::size_t i = 0; i < Slots_.size(); ++i)
+            {
+                if (Used_[i])
+                {
+                    *out++ = Slots_[i];
+                }
+            }
+            return out;
+        }
+
+        inline void Swap(THashSet& set)
+        {
+            Slots_.swap(set.Slots_);
+            Used_.swap(set.Used_);
+            std::swap(Size_, set.Size_);
+        }
+    };
+}
+
+#endif
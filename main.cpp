@@ -1,6 +1,11 @@
+#include <cmath>
 #include <cstdlib>
+#include <limits>
 
+#include "externalsort.hpp"
+#include "querycache.hpp"
 #include "range.hpp"
+#include "scored.hpp"
 
 using namespace NRaingee;
 
@@ -89,6 +94,69 @@ public:
     }
 };
 
+struct TRowSum
+{
+    int operator ()(const int* values, std::size_t size) const
+    {
+        int result = 0;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            result += values[i];
+        }
+        return result;
+    }
+};
+
+// Counts its invocations
+class TCountedIncrement
+{
+    int* Calls_;
+
+public:
+    explicit TCountedIncrement(int* calls)
+        : Calls_(calls)
+    {
+    }
+
+    int operator ()(int value) const
+    {
+        ++*Calls_;
+        return value + 1;
+    }
+};
+
+struct TIntOrder
+{
+    int operator ()(int lhs, int rhs) const
+    {
+        return lhs - rhs;
+    }
+};
+
+// Key without default constructor
+class TKey
+{
+    int Value_;
+
+public:
+    explicit TKey(int value)
+        : Value_(value)
+    {
+    }
+
+    bool operator <(const TKey& key) const
+    {
+        return Value_ < key.Value_;
+    }
+
+#ifndef SPEED_TEST
+    friend std::ostream& operator <<(std::ostream& out, const TKey& key)
+    {
+        return out << key.Value_;
+    }
+#endif
+};
+
 int main()
 {
     int a[] = {1, 3, 5, 7, 9};
@@ -97,8 +165,61 @@ int main()
     TRange<int> r2(b, b + sizeof(b) / sizeof(b[0]));
     int c[] = {1, 2, 3, 4, 9};
     TRange<int> r3(c, c + sizeof(c) / sizeof(c[0]));
+    int d[] = {10, 11, 12};
+    TRange<int> r4(d, d + sizeof(d) / sizeof(d[0]));
     const char p[] = "/usr/portage//distfiles/file\\/.cpp\\";
     const char p2[] = "portage///distfiles/file\\/.cpp/";
+    const std::string w[] = {"book", "pdf", "web"};
+    TRange<std::string> ws(w, w + sizeof(w) / sizeof(w[0]));
+    const std::string w2[] = {"it", "pdf"};
+    TRange<std::string> ws2(w2, w2 + sizeof(w2) / sizeof(w2[0]));
+    const TKey k[] = {TKey(1), TKey(3), TKey(5)};
+    TRange<TKey> ks(k, k + sizeof(k) / sizeof(k[0]));
+    const TKey k2[] = {TKey(3), TKey(4)};
+    TRange<TKey> ks2(k2, k2 + sizeof(k2) / sizeof(k2[0]));
+    TQueryCache<int> cache(1024);
+    std::vector<TRange<int> > rs;
+    rs.push_back(r);
+    rs.push_back(r2);
+    rs.push_back(r3);
+    rs.push_back(TRange<int>(TSequenceGenerator(), 5));
+    typedef std::pair<int, int> TScored;
+    const TScored s1[] = {TScored(1, 5), TScored(3, 1), TScored(5, 2)};
+    const TScored s2[] = {TScored(1, 1), TScored(2, 4), TScored(5, 2)};
+    const TScored s3[] = {TScored(3, 3), TScored(5, 1), TScored(7, 9)};
+    std::vector<TRange<TScored> > ss;
+    ss.push_back(TRange<TScored>(s1, s1 + 3));
+    ss.push_back(TRange<TScored>(s2, s2 + 3));
+    ss.push_back(TRange<TScored>(s3, s3 + 3));
+    const int maxScores[] = {5, 4, 9};
+    std::vector<int> ms(maxScores, maxScores + 3);
+    std::vector<TScored> top;
+    const std::pair<int, int> runs[] = {std::make_pair(10, 13),
+        std::make_pair(1, 3), std::make_pair(3, 4), std::make_pair(20, 20)};
+    TRange<int> iv = Interval(1, 10);
+    iv.Pop();
+    iv.Pop();
+    std::vector<int> large;
+    for (int i = 0; i < 150000; ++i)
+    {
+        large.push_back(i);
+    }
+    std::vector<TRange<int> > sketched;
+    sketched.push_back(TRange<int>(large.begin(), large.begin() + 100000));
+    sketched.push_back(TRange<int>(large.begin() + 50000, large.end()));
+    sketched.push_back(r);
+    sketched.push_back(r3);
+    for (std::size_t i = 0; i < sketched.size(); ++i)
+    {
+        sketched[i].AttachSketch();
+    }
+    std::vector<TRange<int> > sketchedLarge(sketched.begin(),
+        sketched.begin() + 2);
+    std::vector<TRange<int> > sketchedSmall(sketched.begin() + 2,
+        sketched.end());
+    double estimate;
+    std::vector<bool> flags(3, true);
+    flags[0] = false;
     for (int i = 0; i < Cycles; ++i)
     {
         Check(TRange<int>(2, 2), "2 2 ");
@@ -109,6 +230,35 @@ int main()
         Check(r * 3, "1 3 5 7 9 1 3 5 7 9 1 3 5 7 9 ");
         Check((r + r + r) * 2 - (r * 2 - r) * 5, "1 3 5 7 9 ");
         Check(r * 0, "");
+        Check((r | r2) * 2, "1 3 4 5 6 7 9 1 3 4 5 6 7 9 ");
+        Check((r ^ r2) * 2 + (r & (r2 - r3)) * 2,
+            "1 3 4 6 9 1 3 4 6 9 5 7 5 7 ");
+        Check((Interval(1, 3) + TRange<int>(2, 7)) * 2, "1 2 7 7 1 2 7 7 ");
+        Check(Transform<int>(Remove(Unique(r + r3),
+            std::bind2nd(std::equal_to<int>(), 3)),
+            std::negate<int>()) * 2, "-1 -5 -7 -9 -1 -2 -4 -9 "
+            "-1 -5 -7 -9 -1 -2 -4 -9 ");
+        Check(TRange<int>(TRange<int>(TSequenceGenerator(), 3) * 2) * 2,
+            "1 2 3 1 2 3 1 2 3 1 2 3 ");
+        {
+            TRange<int> source(r | r2);
+            TRange<int> cursor(source);
+            cursor.Pop();
+            cursor.Pop();
+            cursor.Rewind(source);
+            Check(cursor, "1 3 4 5 6 7 9 ");
+            cursor.Rewind(r4);
+            Check(cursor, "10 11 12 ");
+            cursor = TRange<int>();
+            cursor.Rewind(source);
+            Check(cursor, "1 3 4 5 6 7 9 ");
+            TRange<int> constant(3, 1);
+            constant.Rewind(TRange<int>(2, 7));
+            Check(constant, "7 7 ");
+            TRange<int> single(5);
+            single.Rewind(TRange<int>(6));
+            Check(single, "6 ");
+        }
         Check(r | r2, "1 3 4 5 6 7 9 ");
         Check((r | r2) & (r2 | r), "1 3 4 5 6 7 9 ");
         Check(((r | r2) & (r2 | r)) & r, "1 3 5 7 9 ");
@@ -122,6 +272,18 @@ int main()
         Check(Includes(r | r2, r));
         Check(!Includes((r - r2) | (r2 - r), r));
         Check(NRaingee::Includes(r, r));
+        Check(Includes(r | r2, r2, ThreeWay(TIntOrder())));
+        Check(!Includes(r, r2, ThreeWay(TIntOrder())));
+        TRange<int> united(r);
+        united.Unite(r3, ThreeWay(TIntOrder()));
+        Check(united, "1 2 3 4 5 7 9 ");
+        TRange<int> intersected(r);
+        intersected.Intersect(r2, ThreeWay(TIntOrder()));
+        Check(intersected, "5 7 ");
+        Check(ws | ws2, "book it pdf web ");
+        Check(ws & ws2, "pdf ");
+        Check(ws ^ ws2, "book it web ");
+        Check(ws - ws2, "book web ");
         Check(r & r3, "1 3 9 ");
         Check(r3 & r, "1 3 9 ");
         Check(r & r2 & r3, "");
@@ -132,8 +294,244 @@ int main()
         Check(r - r3, "5 7 ");
         Check(r3 - r, "2 4 ");
         Check(r3 - r2 - r, "2 ");
+        Check((ks | ks2) & ks, "1 3 5 ");
+        Check((ks ^ ks2) - ks2, "1 5 ");
+        TRange<int> adaptive(Adaptive((r | r2) & (r2 | r3)));
+        Check(adaptive, "1 3 4 5 6 7 9 ");
+        Check(adaptive, "1 3 4 5 6 7 9 ");
+        adaptive.Pop();
+        Check(adaptive, "3 4 5 6 7 9 ");
+        Check(Adaptive(r - r2, 2) * 3, "1 3 9 1 3 9 1 3 9 ");
+        Check(cache.Query(((r & r2) | r3) - r2), "1 2 3 9 ");
+        Check(cache.Query(((r3 | (r2 & r)) - r2)), "1 2 3 9 ");
+        Check(cache.Query(r3 | (r2 & (r | r2))), "1 2 3 4 5 6 7 9 ");
+        Check(cache.GetMisses() == 2);
+        {
+            TQueryCache<int> nested(1024);
+            Check(nested.Query(r2 & (r | r2)), "4 5 6 7 ");
+            Check(nested.Query((r2 | r) & r2), "4 5 6 7 ");
+            Check(nested.Query(r - (r2 | r4)), "1 3 9 ");
+            Check(nested.Query(r - (r4 | r2)), "1 3 9 ");
+            Check(nested.GetHits() == 2);
+        }
+        {
+            TQueryCache<int> disjoint(1024);
+            Check(disjoint.Query(r | r4), "1 3 5 7 9 10 11 12 ");
+            Check(disjoint.Query(r | r4), "1 3 5 7 9 10 11 12 ");
+            Check(disjoint.GetHits() == 1);
+            TRange<int> chain;
+            for (int i = 0; i < 2000; ++i)
+            {
+                chain |= TRange<int>(2000 - i);
+            }
+            Check(Size(chain) == 2000 && chain.Front() == 1);
+        }
+        Check(((r & r2) | r3).IsSameExpression(r3 | (r2 & r)));
+        Check(!(r | r2).IsSameExpression(r | r3));
+        Check(!(r - r2).IsSameExpression(r2 - r));
+        Check(!TRange<int>(r2).IsSameExpression(TRange<int>(b, b + 4)));
         Check(Unique(TRange<int>(5, 7)), "7 ");
         Check(Unique(r - r - r), "");
+        Check(Sort(r2 + r3 + r), "1 1 2 3 3 4 4 5 5 6 7 7 9 9 ");
+        Check(Sort(r2 + r3 + r, std::greater<int>(), 3 * sizeof(int)),
+            "9 9 7 7 6 5 5 4 4 3 3 2 1 1 ");
+        Check(Unique(Sort((r2 + r3 + r) * 100, std::less<int>(), 64)) - r2,
+            "1 2 3 9 ");
+        Check(Size(Sort((r2 + r3 + r) * 100, std::less<int>(), 64)) == 1400);
+        {
+            TRange<int> sorted = Sort(TRange<int>(large.rbegin(),
+                large.rend()), std::less<int>(), 64 * sizeof(int));
+            TRange<int> copy = sorted;
+            for (std::size_t i = 0; i < large.size(); ++i, sorted.Pop())
+            {
+                Check(sorted.Front() == large[i]);
+            }
+            Check(sorted.IsEmpty() && Size(copy) == large.size());
+        }
+        Check(Distinct(r3 + r + r2), "1 2 3 4 9 5 7 6 ");
+        Check(Distinct((r3 + r + r2) * 2
+                + TRange<int>(TSequenceGenerator(), 12), 0),
+            "1 2 3 4 9 5 7 6 8 10 11 12 ");
+        {
+            TRange<int> distinct = Distinct(
+                TRange<int>(large.begin(), large.end()) * 2, 0);
+            for (int i = 0; i < 1000; ++i, distinct.Pop());
+            TRange<int> copy = distinct;
+            Check(Size(distinct) == 149000);
+            Check(Size(copy) == 149000);
+        }
+        Check(Distinct(ws + ws2 + ws), "book pdf web it ");
+        Check(HashIntersect(r3 + r, r2), "4 5 7 ");
+        Check(HashIntersect(r2, r3 + r), "4 5 7 ");
+        Check(HashIntersect(r2, r3 + r, THash<int>(), std::less<int>()),
+            "4 5 7 ");
+        Check(HashIntersect(TRange<int>(TSequenceGenerator(), 12), r2),
+            "4 5 6 7 ");
+        Check(Size(HashIntersect(r + r, r3) * 3) == 18);
+        Check(HashComplement(r3 + r, r2), "1 2 3 9 1 3 9 ");
+        Check(HashComplement(ws2 + ws, ws2), "book web ");
+        Check(Threshold(rs, 1), "1 2 3 4 5 6 7 9 ");
+        Check(Threshold(rs, 2), "1 2 3 4 5 7 9 ");
+        Check(Threshold(rs, 3), "1 3 4 5 ");
+        Check(Threshold(rs, 4), "");
+        {
+            std::vector<TRange<int> > shifted;
+            for (int i = 0; i < 50; ++i)
+            {
+                shifted.push_back(TRange<int>(TSequenceGenerator(i), 20));
+            }
+            Check(Size(Threshold(shifted, 20)) == 31);
+            Check(Sum(Threshold(shifted, 20)) == 1085);
+        }
+        Check(Threshold(rs, 3, ThreeWay(TIntOrder())) * 2, "1 3 4 5 1 3 4 5 ");
+        {
+            std::vector<TRange<int> > exclusions;
+            Check(ComplementAll(r3, exclusions), "1 2 3 4 9 ");
+            exclusions.push_back(r4);
+            exclusions.push_back(r - r);
+            Check(ComplementAll(r3, exclusions), "1 2 3 4 9 ");
+            exclusions.push_back(r);
+            exclusions.push_back(r2);
+            TRange<int> rest(ComplementAll(r3 + r4, exclusions));
+            Check(TRange<int>(rest), "2 ");
+            rest.Pop();
+            Check(rest, "");
+            Check(ComplementAll(r3 | r4, exclusions, ThreeWay(TIntOrder())),
+                "2 ");
+            Check(ComplementAll(Interval(0, 12), exclusions), "0 2 8 ");
+            Check(ComplementAll(r - r, exclusions), "");
+            const int duplicates[] = {1, 1, 2};
+            TRange<int> dups(duplicates, duplicates + 3);
+            exclusions.assign(1, TRange<int>(1));
+            Check(ComplementAll(dups, exclusions), "1 2 ");
+            Check(dups - (TRange<int>(1) | TRange<int>(1)), "1 2 ");
+            exclusions.push_back(TRange<int>(1));
+            Check(ComplementAll(dups, exclusions), "1 2 ");
+            exclusions.push_back(TRange<int>(2, 1));
+            Check(ComplementAll(dups, exclusions), "2 ");
+            exclusions.assign(1, TRange<int>(large.begin(), large.end()));
+            exclusions.push_back(sketched[0]);
+            Check(ComplementAll(r3 | r4, exclusions), "");
+            Check(Size(ComplementAll(Interval(140000, 160000), exclusions))
+                == 10000);
+        }
+        Check(ScoredUnion(ss), "1:6 2:4 3:4 5:5 7:9 ");
+        Check(ScoredUnion(ss, std::multiplies<int>(), std::less<int>()) * 2,
+            "1:5 2:4 3:3 5:4 7:9 1:5 2:4 3:3 5:4 7:9 ");
+        top = TopK(ScoredUnion(ss), 3);
+        Check(TRange<TScored>(top.begin(), top.end()), "7:9 1:6 5:5 ");
+        top = TopK(ss, ms, 3);
+        Check(TRange<TScored>(top.begin(), top.end()), "7:9 1:6 5:5 ");
+        top = TopK(ss, ms, 1);
+        Check(TRange<TScored>(top.begin(), top.end()), "7:9 ");
+        top = TopK(ss, ms, 0);
+        Check(top.empty());
+        Check(Interval(1, 6), "1 2 3 4 5 ");
+        Check(Intervals(runs, runs + 4), "1 2 3 10 11 12 ");
+        Check(Size(Interval<int, TEmptyAssert>(std::numeric_limits<int>::min(),
+            std::numeric_limits<int>::max())) == 4294967295u);
+        Check(Size(Intervals<const std::pair<int, int>*, TEmptyAssert>(runs,
+            runs + 4)) == 6);
+        Check(Interval(1, 6) | Interval(10, 12), "1 2 3 4 5 10 11 ");
+        Check(Interval(1, 10) - Interval(3, 5), "1 2 5 6 7 8 9 ");
+        Check(Interval(1, 10) & Interval(5, 20), "5 6 7 8 9 ");
+        Check(Interval(1, 10) ^ Interval(5, 12), "1 2 3 4 10 11 ");
+        Check(Interval(1, 10) - Interval(0, 20), "");
+        Check(Interval(1, 10) & r, "1 3 5 7 9 ");
+        Check(iv - Interval(5, 6), "3 4 6 7 8 9 ");
+        Check(Size(Interval(0, 1000000000) - Interval(10, 20)) == 999999990);
+        Check(Size(TRange<int>(1000000, 1) + r) == 1000005);
+        Check(Size(r | r2) == 7);
+        Check(Size(r3 + (r - r2)) == 8);
+        Check(CountIntersection(r, r3) == 3);
+        Check(CountIntersection(r * 2, r3) == 3);
+        Check(CountUnion(r, r3) == 7);
+        Check(CountUnion(r + r, r3, ThreeWay(TIntOrder())) == 12);
+        Check(CountDifference(r, r2) == 3);
+        Check(Size(r ^ r3) == 4);
+        Check(Size(Interval(0, 100) - Interval(10, 20)) == 90);
+        Check(AtLeast(r & r3, 3));
+        Check(!AtLeast(r & r3, 4));
+        Check(AtLeast(TRange<int>(TSequenceGenerator(), 100), 5));
+        Check(AtLeast(r + TRange<int>(3, 1000), 8));
+        Check(!AtLeast(r + TRange<int>(3, 1000), 9));
+        Check(AtLeast(r | r4, 8));
+        Check(!AtLeast(r | r4, 9));
+        Check(IsDisjoint(r2, r3 - r2));
+        Check(EstimateUnionSize(sketchedSmall, estimate) && estimate == 7);
+        Check(EstimateIntersectionSize(sketchedSmall, estimate)
+            && estimate == 3);
+        Check(EstimateUnionSize(sketchedLarge, estimate)
+            && std::fabs(estimate - 150000) < 150000 * 0.05);
+        Check(EstimateIntersectionSize(sketchedLarge, estimate)
+            && std::fabs(estimate - 50000) < 50000 * 0.3);
+        Check(EstimateUnionSize(std::vector<TRange<int> >(1,
+            sketched[2] | sketched[3]), estimate) && estimate == 7);
+        Check(!EstimateUnionSize(rs, estimate));
+        Check(r | r4, "1 3 5 7 9 10 11 12 ");
+        Check(r4 | (r2 | r3), "1 2 3 4 5 6 7 9 10 11 12 ");
+        Check(r4 ^ r2, "4 5 6 7 10 11 12 ");
+        Check(r - r4, "1 3 5 7 9 ");
+        Check(r4 - TRange<int>(1), "10 11 12 ");
+        Check((r & r4) * 2, "");
+        Check(((r2 | r3) & r4) + r4, "10 11 12 ");
+        Check(Size(r4 & TRange<int>(TSequenceGenerator(), 5)) == 0);
+        Check(TRange<int>(TSequenceGenerator(), 20) - r4 - r3,
+            "5 6 7 8 13 14 15 16 17 18 19 20 ");
+        Check((r4 + TRange<int>(70000) + TRange<int>(99999)) & sketched[0],
+            "10 11 12 70000 99999 ");
+        Check((TRange<int>(127) + TRange<int>(128) + TRange<int>(256)
+            + TRange<int>(100000)) & sketched[0], "127 128 256 ");
+        Check((r4 + TRange<int>(70000) + TRange<int>(150000)) - sketched[1],
+            "10 11 12 150000 ");
+        Check(View(a, a + 5) & View(b, b + 4), "5 7 ");
+        Check((View(c, c + 5) | View(a, a + 0)) * 2, "1 2 3 4 9 1 2 3 4 9 ");
+        std::vector<int> adopted(large.begin(), large.begin() + 3);
+        Check(Adopt(adopted), "0 1 2 ");
+        Check(adopted.empty());
+        adopted.assign(large.begin(), large.begin() + 3);
+        Check(Adopt<int, TEmptyAssert>(adopted) & View<int, TEmptyAssert>(c,
+            c + 5), "1 2 ");
+        Check(Unique(Adopt(flags)), "0 1 ");
+        Check(flags.empty());
+        TRange<int> popped(5);
+        popped.Pop();
+        Check(TRange<int>(popped.Release()), "");
+        TRange<int> cursor(r);
+        TRange<int> single(8);
+        TRange<int> composite(r | r2);
+        cursor.Pop();
+        cursor.Swap(single);
+        Check(cursor, "8 ");
+        Check(single, "3 5 7 9 ");
+        single.Swap(composite);
+        Check(single, "1 3 4 5 6 7 9 ");
+        Check(composite + cursor, "3 5 7 9 8 ");
+        Check(Move(composite), "3 5 7 9 ");
+        Check(composite, "");
+        TRange<int> compact(Compact(((r | r2) ^ (r3 - TRange<int>(4))) & r));
+        Check(compact, "5 7 ");
+        compact.Pop();
+        Check(Compact(compact) + Compact(r4), "7 10 11 12 ");
+        Check(Compact(TRange<int>()), "");
+        TRange<int> compiled(Compile(Unique((r | r2 | r3) - TRange<int>(4))));
+        Check(compiled, "1 2 3 5 6 7 9 ");
+        compiled.Pop();
+        Check(Compile(compiled ^ Remove(r2, std::bind2nd(
+            std::modulus<int>(), 2))), "2 3 4 5 7 9 ");
+        Check(Compile(Unique(r2 & (r + r2))), "5 7 ");
+        Check(Compile(r), "1 3 5 7 9 ");
+        Check(Compile((r4 | r) ^ r2), "1 3 4 6 9 10 11 12 ");
+        Check(Compile(Threshold(rs, 2)) == Threshold(rs, 2));
+        TRange<int> evens(Remove(sketched[1], std::bind2nd(
+            std::modulus<int>(), 2)));
+        TRange<int> triples(Remove(TRange<int>(TSequenceGenerator(), 120000),
+            std::bind2nd(std::modulus<int>(), 3)));
+        triples.Shrink();
+        TRange<int> query(((sketched[0] ^ evens) - sketched[2]) | triples);
+        Check(Compile(query) == query);
+        Check(Size(Compile(query)) == Size(query));
+        Check(!IsDisjoint(r, r2 * 100));
         Check((r - r3) & (r3 - r) & TRange<int>(4), "");
         Check(TRange<int>(4) & (r * 0) & TRange<int>(4), "");
         Check(Unique(TRange<int>(1) * 2 + TRange<int>(2)* 5 + TRange<int>(3)),
@@ -153,6 +551,65 @@ int main()
         Check(Size(r) == 5);
         Check(Size(r * 3) == 15);
         Check(Size(r & r2) == 2);
+        Check(Sum(r) == 25);
+        Check(Sum(r * 3 + r4) == 108);
+        Check(Sum(TRange<int>(3, 1000) - r) == 3000);
+        Check(Sum(Remove(Interval(1, 10),
+            std::bind2nd(std::modulus<int>(), 2))) == 20);
+        Check(Sum(Compile(r | r2 | r3)) == 37);
+        Check(Sum(TRange<int>(TSequenceGenerator(), 100)) == 5050);
+        Check(Sum(TRange<int>()) == 0);
+        Check(Reduce(TRange<int>(large.begin(), large.end()), 0.,
+            std::plus<double>()) == 11249925000.);
+        Check(ParallelReduce(TRange<int>(large.begin(), large.end()) * 3, 0.,
+            std::plus<double>(), 4) == 33749775000.);
+        Check(ParallelReduce(r, 1, std::multiplies<int>()) == 945);
+        {
+            const TRange<int> merged(r | r2);
+            std::vector<int> pulled(begin(merged), end(merged));
+            Check(TRange<int>(pulled.begin(), pulled.end()),
+                "1 3 4 5 6 7 9 ");
+            int buffer[15];
+            Check(std::copy(begin(r * 3), end(r * 3), buffer) == buffer + 15);
+            Check(buffer[14] == 9 && buffer[5] == 1);
+            Check(std::distance(begin(r - r), end(r - r)) == 0);
+            TRange<int> all(large.begin(), large.end());
+            TRangeIterator<int, TEmptyAssert> iter =
+                std::find(begin(all), end(all), 100000);
+            Check(iter != end(all) && *iter == 100000);
+            Check(*iter++ == 100000 && *iter == 100001);
+            Check(Size(all) == 150000);
+#if __cplusplus >= 201103L
+            int sum = 0;
+            for (int value: r & r2)
+            {
+                sum += value;
+            }
+            Check(sum == 12);
+#endif
+        }
+        Check(Min(r2 | r3) == 1);
+        Check(Max(r2 | r3) == 9);
+        Check(Min(Transform<int>(r, std::negate<int>())) == -9);
+        Check(Max(r, std::greater<int>()) == 1);
+        Check(Any(r, std::bind2nd(std::equal_to<int>(), 5)));
+        Check(!Any(r, std::bind2nd(std::equal_to<int>(), 4)));
+        Check(All(r, std::bind2nd(std::modulus<int>(), 2)));
+        Check(!All(r3, std::bind2nd(std::modulus<int>(), 2)));
+        Check(All(r - r, std::bind2nd(std::modulus<int>(), 2)));
+        {
+            std::vector<int> copied;
+            CopyTo(Transform<int>(r | r2, std::negate<int>()),
+                std::back_inserter(copied));
+            Check(TRange<int>(copied.begin(), copied.end()),
+                "-1 -3 -4 -5 -6 -7 -9 ");
+            std::vector<bool> mask(3, true);
+            std::vector<bool> bits(3);
+            mask[1] = false;
+            Check(CopyTo(TRange<bool>(mask.begin(), mask.end()),
+                bits.begin()) == bits.end());
+            Check(TRange<bool>(bits.begin(), bits.end()), "1 0 1 ");
+        }
         Check(Remove(r, std::bind1st(std::equal_to<int>(), 7)), "1 3 5 9 ");
         Check(Remove(r + r, std::bind2nd(std::modulus<int>(), 3)), "3 9 3 9 ");
         Check(Transform<bool>(r3, std::bind2nd(std::divides<int>(), 3)),
@@ -162,7 +619,65 @@ int main()
             "-1 1 3 5 7 -1 1 3 5 7 ");
         Check(Transform<bool>(r, std::bind1st(std::less<int>(), 5)),
             "0 0 0 1 1 ");
+        Check(CachedTransform<int>(r + r, std::bind2nd(std::minus<int>(), 2)),
+            "-1 1 3 5 7 -1 1 3 5 7 ");
+        {
+            TRange<int> fused(Remove(Remove(r3,
+                std::bind2nd(std::equal_to<int>(), 2)),
+                std::bind2nd(std::equal_to<int>(), 4)));
+            Check(Remove(TRange<int>(fused),
+                std::bind2nd(std::equal_to<int>(), 1)), "3 9 ");
+            Check(fused, "1 3 9 ");
+            Check(Compile(fused | r2), "1 3 4 5 6 7 9 ");
+            TRange<int> shifted(Transform<int>(Transform<int>(r,
+                std::bind2nd(std::plus<int>(), 1)),
+                std::bind2nd(std::multiplies<int>(), 3)));
+            Check(TRange<int>(shifted), "6 12 18 24 30 ");
+            Check(Transform<int>(shifted, std::bind2nd(std::minus<int>(), 6)),
+                "0 6 12 18 24 ");
+            TRange<int> filtered(Remove(Transform<int>(r,
+                std::bind2nd(std::plus<int>(), 1)),
+                std::bind2nd(std::modulus<int>(), 4)));
+            Check(TRange<int>(filtered), "4 8 ");
+            Check(Sum(filtered) == 12);
+            Check(Sum(Remove(Transform<int>(TRange<int>(large.begin(),
+                large.begin() + 1000), std::bind2nd(std::plus<int>(), 1)),
+                std::bind2nd(std::modulus<int>(), 2))) == 250500);
+            int calls = 0;
+            Check(Sum(Remove(Transform<int>(TRange<int>(large.begin(),
+                large.begin() + 1000), TCountedIncrement(&calls)),
+                std::bind2nd(std::modulus<int>(), 2))) == 250500);
+            Check(calls == 1000);
+            Check(Remove(filtered, std::bind2nd(std::equal_to<int>(), 4)),
+                "8 ");
+            Check(Remove(Transform<int>(r2 & r, std::negate<int>()),
+                std::bind2nd(std::less<int>(), -5)), "-5 ");
+            Check(Remove(Transform<bool>(r, std::bind2nd(std::less<int>(), 4)),
+                std::logical_not<bool>()), "1 1 ");
+        }
+        Check(Remove(CachedTransform<int>(r,
+                    std::bind2nd(std::plus<int>(), 1)),
+                std::bind2nd(std::modulus<int>(), 4)) | r2,
+            "4 5 6 7 8 ");
         Check(Transform<int>(r2, r, std::minus<double>()), "3 2 1 0 ");
+        {
+            std::vector<TRange<int> > columns;
+            Check(Transform<int>(columns, TRowSum()), "");
+            columns.push_back(r);
+            columns.push_back(r2);
+            columns.push_back(r3);
+            TRange<int> zipped(Transform<int>(columns, TRowSum()));
+            zipped.Pop();
+            Check(TRange<int>(zipped), "10 14 18 ");
+            Check(zipped, "10 14 18 ");
+            columns.push_back(r - r);
+            Check(Transform<int>(columns, TRowSum()), "");
+            columns.assign(3, TRange<int>(large.begin(), large.end()));
+            columns[1] = columns[1] * 2;
+            Check(Size(Transform<int>(columns, TRowSum())) == 150000);
+            Check(Reduce(Transform<int>(columns, TRowSum()), 0.,
+                std::plus<double>()) == 33749775000.);
+        }
         Check(Transform<int>(r, r, std::multiplies<int>()), "1 9 25 49 81 ");
         Check(Transform<int>(r, r2 ^ r2, std::less<int>()), "");
         Check(Transform<int>(r - r, r2, std::less<int>()), "");
@@ -0,0 +1,209 @@
+/*
+ * parallel.hpp             -- helpers for running tasks concurrently
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PARALLEL_HPP_2026_10_18__
+#define __PARALLEL_HPP_2026_10_18__
+
+#include <algorithm>
+
+#if __cplusplus >= 201103L
+#include <exception>
+#include <thread>
+#endif
+
+namespace NRaingee
+{
+    // Threads are available only in C++11 builds, tasks are run one after
+    // another otherwise
+    static inline unsigned HardwareThreads()
+    {
+#if __cplusplus >= 201103L
+        const unsigned result = std::thread::hardware_concurrency();
+        return result ? result : 1;
+#else
+        return 1;
+#endif
+    }
+
+#if __cplusplus >= 201103L
+    // Runs task in a thread and keeps exception thrown, so it can be
+    // rethrown in the caller thread
+    template <class TTask>
+    class TThreadTask
+    {
+        TTask Task_;
+        std::exception_ptr& Exception_;
+
+    public:
+        inline TThreadTask(TTask task, std::exception_ptr& exception)
+            : Task_(task)
+            , Exception_(exception)
+        {
+        }
+
+        inline void operator ()()
+        {
+            try
+            {
+                Task_();
+            }
+            catch (...)
+            {
+                Exception_ = std::current_exception();
+            }
+        }
+    };
+#endif
+
+    // Runs both tasks and returns when both are finished. If any of tasks
+    // throws, exception is rethrown after both of them are finished.
+    template <class TFirstTask, class TSecondTask>
+    static inline void ParallelInvoke(TFirstTask first, TSecondTask second)
+    {
+#if __cplusplus >= 201103L
+        std::exception_ptr exception;
+        std::thread thread(TThreadTask<TFirstTask>(first, exception));
+        try
+        {
+            second();
+        }
+        catch (...)
+        {
+            thread.join();
+            throw;
+        }
+        thread.join();
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+#else
+        first();
+        second();
+#endif
+    }
+
+    template <class TIterator, class TCompare>
+    static void ParallelSort(TIterator begin, TIterator end, TCompare compare,
+        unsigned threads);
+
+    template <class TIterator, class TCompare>
+    class TSortTask
+    {
+        const TIterator Begin_;
+        const TIterator End_;
+        const TCompare Compare_;
+        const unsigned Threads_;
+
+    public:
+        inline TSortTask(TIterator begin, TIterator end, TCompare compare,
+            unsigned threads)
+            : Begin_(begin)
+            , End_(end)
+            , Compare_(compare)
+            , Threads_(threads)
+        {
+        }
+
+        inline void operator ()() const
+        {
+            ParallelSort(Begin_, End_, Compare_, Threads_);
+        }
+    };
+
+    // Sorts halves concurrently and merges them, small inputs are sorted
+    // in place
+    template <class TIterator, class TCompare>
+    static void ParallelSort(TIterator begin, TIterator end, TCompare compare,
+        unsigned threads)
+    {
+        if (threads < 2 || end - begin < 65536)
+        {
+            std::sort(begin, end, compare);
+        }
+        else
+        {
+            const TIterator middle = begin + (end - begin) / 2;
+            ParallelInvoke(
+                TSortTask<TIterator, TCompare>(begin, middle, compare,
+                    threads / 2),
+                TSortTask<TIterator, TCompare>(middle, end, compare,
+                    threads - threads / 2));
+            std::inplace_merge(begin, middle, end, compare);
+        }
+    }
+
+    template <class TIterator, class TType, class TBinaryOp>
+    static TType ParallelReduce(TIterator begin, TIterator end, TType init,
+        TBinaryOp op, unsigned threads);
+
+    template <class TIterator, class TType, class TBinaryOp>
+    class TReduceTask
+    {
+        const TIterator Begin_;
+        const TIterator End_;
+        const TBinaryOp Op_;
+        const unsigned Threads_;
+        TType* const Result_;
+
+    public:
+        inline TReduceTask(TIterator begin, TIterator end, TBinaryOp op,
+            unsigned threads, TType* result)
+            : Begin_(begin)
+            , End_(end)
+            , Op_(op)
+            , Threads_(threads)
+            , Result_(result)
+        {
+        }
+
+        inline void operator ()() const
+        {
+            *Result_ = ParallelReduce(Begin_ + 1, End_, TType(*Begin_), Op_,
+                Threads_);
+        }
+    };
+
+    // Reduces halves concurrently, each starting with its first element, so
+    // that op needs to be associative only. Small inputs are reduced in place.
+    template <class TIterator, class TType, class TBinaryOp>
+    static TType ParallelReduce(TIterator begin, TIterator end, TType init,
+        TBinaryOp op, unsigned threads)
+    {
+        if (threads < 2 || end - begin < 65536)
+        {
+            for (; begin != end; ++begin)
+            {
+                init = op(init, *begin);
+            }
+            return init;
+        }
+        const TIterator middle = begin + (end - begin) / 2;
+        TType first = init;
+        TType second = init;
+        ParallelInvoke(
+            TReduceTask<TIterator, TType, TBinaryOp>(begin, middle, op,
+                threads / 2, &first),
+            TReduceTask<TIterator, TType, TBinaryOp>(middle, end, op,
+                threads - threads / 2, &second));
+        return op(op(init, first), second);
+    }
+}
+
+#endif
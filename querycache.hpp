@@ -0,0 +1,211 @@
+/*
+ * querycache.hpp           -- cache of materialized range expressions
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUERYCACHE_HPP_2026_10_18__
+#define __QUERYCACHE_HPP_2026_10_18__
+
+#include <cstddef>
+#include <list>
+#include <map>
+
+#include "range.hpp"
+
+namespace NRaingee
+{
+    // Default locking policy, for single-threaded use. Any BasicLockable
+    // type, like std::mutex, can be used instead.
+    struct TFakeMutex
+    {
+        inline void lock()
+        {
+        }
+
+        inline void unlock()
+        {
+        }
+    };
+
+    // Bounded LRU cache of shrunk range expressions keyed by their
+    // fingerprints. Each entry holds a copy of the original expression, so
+    // the leaves it refers to can't be freed and reused while it is cached.
+    template <class TType, class TMutex = TFakeMutex,
+        class TAssert = TEmptyAssert>
+    class TQueryCache
+    {
+        typedef TRange<TType, TAssert> TRange_;
+
+        struct TEntry_
+        {
+            TFingerprint Fingerprint_;
+            TRange_ Expression_;
+            TRange_ Result_;
+            std::size_t Size_;
+        };
+
+        typedef std::list<TEntry_> TEntries_;
+        typedef std::map<TFingerprint, typename TEntries_::iterator> TIndex_;
+
+        class TGuard_
+        {
+            TMutex& Mutex_;
+
+            TGuard_(const TGuard_&);
+            TGuard_& operator =(const TGuard_&);
+
+        public:
+            inline explicit TGuard_(TMutex& mutex)
+                : Mutex_(mutex)
+            {
+                Mutex_.lock();
+            }
+
+            inline ~TGuard_()
+            {
+                Mutex_.unlock();
+            }
+        };
+
+        TQueryCache(const TQueryCache&);
+        TQueryCache& operator =(const TQueryCache&);
+
+        // Most recently used entries go first
+        TEntries_ Entries_;
+        TIndex_ Index_;
+        const std::size_t Budget_;
+        std::size_t Used_;
+        std::size_t Hits_;
+        std::size_t Misses_;
+        mutable TMutex Mutex_;
+
+        // Entries with the same fingerprint are hits only if they hold the
+        // same expression, since fingerprints of different expressions may
+        // collide
+        bool Find(TFingerprint fingerprint, const TRange_& range,
+            TRange_& result)
+        {
+            typename TIndex_::iterator iter = Index_.find(fingerprint);
+            if (iter == Index_.end()
+                || !iter->second->Expression_.IsSameExpression(range))
+            {
+                return false;
+            }
+            Entries_.splice(Entries_.begin(), Entries_, iter->second);
+            TRange_(Entries_.front().Result_).Swap(result);
+            return true;
+        }
+
+        inline void Erase(typename TEntries_::iterator entry)
+        {
+            Used_ -= entry->Size_;
+            Index_.erase(entry->Fingerprint_);
+            Entries_.erase(entry);
+        }
+
+    public:
+        inline explicit TQueryCache(std::size_t budget)
+            : Budget_(budget)
+            , Used_(0)
+            , Hits_(0)
+            , Misses_(0)
+        {
+        }
+
+        // Returns shared cursor over materialized result of the expression.
+        // Expressions without fingerprint are returned as is.
+        TRange_ Query(TRange_ range)
+        {
+            const TFingerprint fingerprint = range.Fingerprint();
+            if (!fingerprint)
+            {
+                return Move(range);
+            }
+
+            TRange_ result;
+            {
+                TGuard_ guard(Mutex_);
+                if (Find(fingerprint, range, result))
+                {
+                    ++Hits_;
+                    return result;
+                }
+                ++Misses_;
+            }
+
+            // Evaluate without holding the lock
+            TEntry_ entry;
+            entry.Fingerprint_ = fingerprint;
+            entry.Expression_ = range;
+            range.Shrink();
+            entry.Size_ = sizeof(TEntry_) + sizeof(TType) * Size(range);
+            if (entry.Size_ > Budget_)
+            {
+                return Move(range);
+            }
+            entry.Result_.Swap(range);
+
+            TGuard_ guard(Mutex_);
+            if (!Find(fingerprint, entry.Expression_, result))
+            {
+                // Colliding entry of another expression is replaced
+                typename TIndex_::iterator iter = Index_.find(fingerprint);
+                if (iter != Index_.end())
+                {
+                    Erase(iter->second);
+                }
+                Entries_.push_front(entry);
+                Index_[fingerprint] = Entries_.begin();
+                Used_ += entry.Size_;
+                while (Used_ > Budget_)
+                {
+                    Erase(--Entries_.end());
+                }
+                TRange_(Entries_.front().Result_).Swap(result);
+            }
+            return result;
+        }
+
+        void Clear()
+        {
+            TGuard_ guard(Mutex_);
+            Entries_.clear();
+            Index_.clear();
+            Used_ = 0;
+        }
+
+        inline std::size_t GetHits() const
+        {
+            TGuard_ guard(Mutex_);
+            return Hits_;
+        }
+
+        inline std::size_t GetMisses() const
+        {
+            TGuard_ guard(Mutex_);
+            return Misses_;
+        }
+
+        inline std::size_t GetUsed() const
+        {
+            TGuard_ guard(Mutex_);
+            return Used_;
+        }
+    };
+}
+
+#endif
@@ -20,14 +20,20 @@
 #ifndef __RANGE_HPP_2012_01_31__
 #define __RANGE_HPP_2012_01_31__
 
+#include <algorithm>
+#include <cstddef>
 #include <functional>
 #include <iterator>
 #include <limits>
+#include <utility>
+#include <vector>
 
 #include <reinvented-wheels/enableif.hpp>
 
+#include "compare.hpp"
 #include "emptyassert.hpp"
 #include "iscallable.hpp"
+#include "parallel.hpp"
 #include "predicates.hpp"
 #include "rangeimpl.hpp"
 
@@ -37,13 +43,101 @@ namespace NRaingee
     class TRange
     {
         IRangeImpl<TType>* Impl_;
+        // Leaf implementations which fit here are constructed in place
+        TRangeBuffer Buffer_;
+
+        template <class TImpl>
+        static inline bool Fits()
+        {
+            return sizeof(TImpl) <= sizeof(TRangeBuffer);
+        }
+
+        inline bool IsBuffered() const
+        {
+            const char* impl = reinterpret_cast<const char*>(Impl_);
+            std::less<const char*> less;
+            return !less(impl, Buffer_.Data_)
+                && less(impl, Buffer_.Data_ + sizeof(Buffer_));
+        }
+
+        inline void Destroy()
+        {
+            if (IsBuffered())
+            {
+                Impl_->~IRangeImpl();
+            }
+            else
+            {
+                delete Impl_;
+            }
+        }
 
         inline void Clear()
         {
-            delete Impl_;
+            Destroy();
             Impl_ = 0;
         }
 
+        // Moves implementation out of buffer, so it can be owned by a node
+        inline IRangeImpl<TType>* Unbuffer()
+        {
+            if (IsBuffered())
+            {
+                IRangeImpl<TType>* impl = Impl_->MoveTo(0);
+                Impl_->~IRangeImpl();
+                Impl_ = impl;
+            }
+            return Impl_;
+        }
+
+        // Takes implementation of range while this range is null
+        inline void Take(TRange& range)
+        {
+            if (range.IsBuffered())
+            {
+                Impl_ = range.Impl_->MoveTo(&Buffer_);
+                range.Clear();
+            }
+            else
+            {
+                Impl_ = range.Impl_;
+                range.Impl_ = 0;
+            }
+        }
+
+        // Replaces range with result of run arithmetic, if both ranges are
+        // interval ranges ordered by std::less
+        template <class TCompare>
+        inline bool CombineIntervals(const TRange&, TCompare, unsigned)
+        {
+            return false;
+        }
+
+        bool CombineIntervals(const TRange& range, std::less<TType>,
+            unsigned table)
+        {
+            IRangeImpl<TType>* result = 0;
+            if (TIntervalArithmetic<TType,
+                std::numeric_limits<TType>::is_integer>::Combine(Impl_,
+                    range.Impl_, table, result))
+            {
+                Destroy();
+                Impl_ = result;
+                return true;
+            }
+            return false;
+        }
+
+        // Checks with bounds of non-empty ranges that all elements of this
+        // range precede elements of range
+        template <class TCompare>
+        bool Precedes(const TRange& range, TCompare& compare) const
+        {
+            const TBounds<TType> bounds(Impl_);
+            return bounds.IsKnown()
+                && bounds.Precedes(TBounds<TType>(range.Impl_), compare);
+        }
+
     public:
         typedef typename TSequenceRangeImpl<TType>::TSizeType_ TSizeType_;
 
@@ -53,13 +147,19 @@ namespace NRaingee
         }
 
         inline TRange(const TRange& range)
-            : Impl_(range.IsEmpty() ? 0 : range.Impl_->Clone())
+            : Impl_(range.IsEmpty() ? 0 : range.Impl_->CloneTo(Buffer_))
         {
         }
 
         inline TRange(TSizeType_ size, const TType& value)
-            : Impl_(size ? new TSequenceRangeImpl<TType>(size, value) : 0)
+            : Impl_(0)
         {
+            typedef TConstantRangeImpl<TType> TImpl;
+            if (size)
+            {
+                Impl_ = Fits<TImpl>() ?
+                    new (&Buffer_) TImpl(size, value) : new TImpl(size, value);
+            }
         }
 
         template <class TInputIterator>
@@ -67,9 +167,14 @@ namespace NRaingee
             typename NReinventedWheels::TEnableIf<
                 !std::numeric_limits<TInputIterator>::is_integer
                 && !TIsCallable<TInputIterator>::Value_>::TType_* = 0)
-            : Impl_(first == last ?
-                0 : new TSequenceRangeImpl<TType>(first, last))
+            : Impl_(0)
         {
+            typedef TSequenceRangeImpl<TType> TImpl;
+            if (first != last)
+            {
+                Impl_ = Fits<TImpl>() ?
+                    new (&Buffer_) TImpl(first, last) : new TImpl(first, last);
+            }
         }
 
         template <class TGenerator, class TCounter>
@@ -83,8 +188,10 @@ namespace NRaingee
         }
 
         inline explicit TRange(const TType& value)
-            : Impl_(new TSingleValueRangeImpl<TType>(value))
         {
+            typedef TSingleValueRangeImpl<TType> TImpl;
+            Impl_ = Fits<TImpl>() ?
+                new (&Buffer_) TImpl(value) : new TImpl(value);
         }
 
         inline TRange& operator =(TRange range)
@@ -95,12 +202,13 @@ namespace NRaingee
 
         inline ~TRange()
         {
-            delete Impl_;
+            Destroy();
         }
 
+        // Passes ownership of heap allocated implementation to caller
         IRangeImpl<TType>* Release()
         {
-            IRangeImpl<TType>* result = Impl_;
+            IRangeImpl<TType>* result = Unbuffer();
             Impl_ = 0;
             return result;
         }
@@ -124,11 +232,126 @@ namespace NRaingee
             return Impl_->Front();
         }
 
+        inline TFingerprint Fingerprint() const
+        {
+            return Impl_ ? Impl_->Fingerprint() : 0;
+        }
+
+        // Checks that range is the same expression, which is not implied by
+        // equal fingerprints
+        inline bool IsSameExpression(const TRange& range) const
+        {
+            return Impl_ && range.Impl_
+                && Impl_->IsSameExpression(*range.Impl_);
+        }
+
+        // Pops up to size elements into buffer and returns their number, which
+        // is less than size only if range is exhausted
+        inline std::size_t Read(TType* buffer, std::size_t size)
+        {
+            return Impl_ ? Impl_->Read(buffer, size) : 0;
+        }
+
+        // Computes sketch of materialized range for size estimates, returns
+        // false if range is not materialized
+        template <class THashFunc>
+        bool AttachSketch(THashFunc hash)
+        {
+            TSequenceRangeImpl<TType>* sequence =
+                dynamic_cast<TSequenceRangeImpl<TType>*>(Impl_);
+            if (sequence)
+            {
+                sequence->AttachSketch(hash);
+            }
+            return sequence;
+        }
+
+        inline bool AttachSketch()
+        {
+            return AttachSketch(THash<TType>());
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return !Impl_ || Impl_->MergeSketch(sketch);
+        }
+
+        // Returns false if size can't be found without iterating
+        inline bool GetSize(std::size_t& size) const
+        {
+            if (IsEmpty())
+            {
+                size = 0;
+                return true;
+            }
+            else
+            {
+                return Impl_->GetSize(size);
+            }
+        }
+
+        // Returns false if size is unknown without walking the range
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            if (IsEmpty())
+            {
+                size = 0;
+                return true;
+            }
+            else
+            {
+                return Impl_->GetKnownSize(size);
+            }
+        }
+
+        // Returns false if size can't be estimated without iterating
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            if (IsEmpty())
+            {
+                size = 0;
+                return true;
+            }
+            else
+            {
+                return Impl_->EstimateSize(size);
+            }
+        }
+
         inline void Swap(TRange& range)
         {
-            IRangeImpl<TType>* tmp = Impl_;
-            Impl_ = range.Impl_;
-            range.Impl_ = tmp;
+            if (!IsBuffered() && !range.IsBuffered())
+            {
+                IRangeImpl<TType>* tmp = Impl_;
+                Impl_ = range.Impl_;
+                range.Impl_ = tmp;
+            }
+            else if (!Impl_)
+            {
+                Take(range);
+            }
+            else if (!range.Impl_)
+            {
+                range.Take(*this);
+            }
+            else
+            {
+                TRange tmp;
+                tmp.Take(*this);
+                Take(range);
+                range.Take(tmp);
+            }
+        }
+
+        // Resets range to the state of source, which it must be a copy of,
+        // reusing nodes in place where possible, so that repeated runs of the
+        // same query don't allocate
+        inline void Rewind(const TRange& source)
+        {
+            if (!Impl_ || !source.Impl_ || !RewindRange(Impl_, *source.Impl_))
+            {
+                TRange(source).Swap(*this);
+            }
         }
 
         inline void Shrink()
@@ -141,11 +364,57 @@ namespace NRaingee
                 }
                 else
                 {
-                    Impl_ = new TSequenceRangeImpl<TType>(Impl_);
+                    Impl_ = new TSequenceRangeImpl<TType>(Unbuffer());
+                }
+            }
+        }
+
+        // Replaces expression with copy laid out in single block in the
+        // order of cloning, so that children are adjacent to their parents.
+        // Nodes are measured by a trial copy first. Nodes which don't
+        // support arena allocation are copied on heap.
+        inline void Compact()
+        {
+            if (!IsEmpty())
+            {
+                std::size_t size;
+                {
+                    TArenaScope trial(0);
+                    TRange copy(Impl_->CloneTo(trial.GetArena()));
+                    size = trial.GetUsed();
+                }
+                TArenaScope scope(size);
+                TRange(Impl_->CloneTo(scope.GetArena())).Swap(*this);
+            }
+        }
+
+        // Replaces set algebra over sequences with compiled program, other
+        // ranges are left as is
+        inline void Compile()
+        {
+            if (!IsEmpty())
+            {
+                IRangeImpl<TType>* compiled =
+                    TCompiledRangeImpl<TType>::Compile(Impl_);
+                if (compiled)
+                {
+                    Clear();
+                    Impl_ = compiled;
                 }
             }
         }
 
+        // Opt-in, since statistics cost an allocation per subtree and a
+        // counter update per element, and copies sharing statistics must
+        // be iterated by one thread at a time
+        inline void Adapt(unsigned threshold = 1)
+        {
+            if (!IsEmpty())
+            {
+                Impl_ = new TAdaptiveRangeImpl<TType>(Unbuffer(), threshold);
+            }
+        }
+
         template <class TCounter>
         inline TRange& operator *=(TCounter counter)
         {
@@ -157,7 +426,7 @@ namespace NRaingee
                 }
                 else
                 {
-                    Impl_ = new TRepeatedRangeImpl<TType, TCounter>(Impl_,
+                    Impl_ = new TRepeatedRangeImpl<TType, TCounter>(Unbuffer(),
                         counter);
                 }
             }
@@ -172,7 +441,7 @@ namespace NRaingee
             }
             else if (!range.IsEmpty())
             {
-                Impl_ = new TConcatenatedRangesImpl<TType>(Impl_, range);
+                Impl_ = new TConcatenatedRangesImpl<TType>(Unbuffer(), range);
             }
             return *this;
         }
@@ -180,16 +449,19 @@ namespace NRaingee
         template <class TCompare>
         inline void Complement(TRange range, TCompare compare)
         {
-            if (!IsEmpty() && !range.IsEmpty())
+            if (!IsEmpty() && !range.IsEmpty() && !CombineIntervals(range,
+                compare, TSetOperation::Difference_)
+                && !Precedes(range, compare)
+                && !range.Precedes(*this, compare))
             {
-                Impl_ = new TComplementedRangesImpl<TType, TCompare>(Impl_,
-                    range, compare);
+                Impl_ = new TComplementedRangesImpl<TType, TCompare>(
+                    Unbuffer(), range, compare);
             }
         }
 
         inline TRange& operator -=(TRange range)
         {
-            Complement(TRange(range.Release()), std::less<TType>());
+            Complement(Move(range), std::less<TType>());
             return *this;
         }
 
@@ -200,16 +472,17 @@ namespace NRaingee
             {
                 Swap(range);
             }
-            else if (!range.IsEmpty())
+            else if (!range.IsEmpty() && !CombineIntervals(range, compare,
+                TSetOperation::Union_))
             {
-                Impl_ = new TUnitedRangesImpl<TType, TCompare>(Impl_, range,
-                    compare);
+                Impl_ = new TUnitedRangesImpl<TType, TCompare>(
+                    Unbuffer(), range, compare);
             }
         }
 
         inline TRange& operator |=(TRange range)
         {
-            Unite(TRange(range.Release()), std::less<TType>());
+            Unite(Move(range), std::less<TType>());
             return *this;
         }
 
@@ -218,21 +491,23 @@ namespace NRaingee
         {
             if (!IsEmpty())
             {
-                if(range.IsEmpty())
+                if(range.IsEmpty() || Precedes(range, compare)
+                    || range.Precedes(*this, compare))
                 {
                     Clear();
                 }
-                else
+                else if (!CombineIntervals(range, compare,
+                    TSetOperation::Intersection_))
                 {
-                    Impl_ = new TIntersectedRangesImpl<TType, TCompare>(Impl_,
-                        range, compare);
+                    Impl_ = new TIntersectedRangesImpl<TType, TCompare>(
+                        Unbuffer(), range, compare);
                 }
             }
         }
 
         inline TRange& operator &=(TRange range)
         {
-            Intersect(TRange(range.Release()), std::less<TType>());
+            Intersect(Move(range), std::less<TType>());
             return *this;
         }
 
@@ -243,16 +518,17 @@ namespace NRaingee
             {
                 Swap(range);
             }
-            else if (!range.IsEmpty())
+            else if (!range.IsEmpty() && !CombineIntervals(range, compare,
+                TSetOperation::SymmetricDifference_))
             {
-                Impl_ = new TSymmetricDifferenceImpl<TType, TCompare>(Impl_,
-                    range, compare);
+                Impl_ = new TSymmetricDifferenceImpl<TType, TCompare>(
+                    Unbuffer(), range, compare);
             }
         }
 
         inline TRange& operator ^=(TRange range)
         {
-            SymmetricDifference(TRange(range.Release()), std::less<TType>());
+            SymmetricDifference(Move(range), std::less<TType>());
             return *this;
         }
 
@@ -261,7 +537,8 @@ namespace NRaingee
         {
             if (!IsEmpty())
             {
-                Impl_ = new TUniqueRangeImpl<TType, TCompare>(Impl_, compare);
+                Impl_ = new TUniqueRangeImpl<TType, TCompare>(
+                    Unbuffer(), compare);
             }
         }
 
@@ -270,62 +547,141 @@ namespace NRaingee
             Unique(std::equal_to<TType>());
         }
 
+        // Hash table of seen values takes at most tableLimit bytes, values
+        // beyond it are kept in sorted runs, which are not limited
+        template <class THashFunc, class TCompare>
+        inline void Distinct(THashFunc hash, TCompare compare,
+            std::size_t tableLimit)
+        {
+            if (!IsEmpty())
+            {
+                Impl_ = new TDistinctRangeImpl<TType, THashFunc, TCompare>(
+                    Unbuffer(), hash, compare, tableLimit);
+            }
+        }
+
+        inline void Distinct(std::size_t tableLimit = 1 << 24)
+        {
+            Distinct(THash<TType>(), std::less<TType>(), tableLimit);
+        }
+
+        // Keeps elements which are present in build range
+        template <class THashFunc, class TCompare>
+        inline void HashIntersect(TRange build, THashFunc hash,
+            TCompare compare)
+        {
+            if (!IsEmpty())
+            {
+                if (build.IsEmpty())
+                {
+                    Clear();
+                }
+                else
+                {
+                    Impl_ = new THashJoinImpl<TType, THashFunc, TCompare>(
+                        Unbuffer(), build.Release(), hash, compare, true);
+                }
+            }
+        }
+
+        // Removes elements which are present in build range
+        template <class THashFunc, class TCompare>
+        inline void HashComplement(TRange build, THashFunc hash,
+            TCompare compare)
+        {
+            if (!IsEmpty() && !build.IsEmpty())
+            {
+                Impl_ = new THashJoinImpl<TType, THashFunc, TCompare>(
+                    Unbuffer(), build.Release(), hash, compare, false);
+            }
+        }
+
+        // Remove over Remove with the same predicate type and Remove over
+        // Transform are fused into a single node
         template <class TPredicate>
-        inline void Remove(TPredicate predicate)
+        void Remove(TPredicate predicate)
         {
             if (!IsEmpty())
             {
-                Impl_ = new TRemoveImpl<TType, TPredicate>(Impl_, predicate);
+                typedef TRemoveImpl<TType, TPredicate> TRemoveImpl_;
+                TRemoveImpl_* remove = dynamic_cast<TRemoveImpl_*>(Impl_);
+                IRangeImpl<TType>* fused = 0;
+                if (remove)
+                {
+                    remove->Fuse(predicate);
+                }
+                else if ((fused = Impl_->FuseFilter(
+                    TErasedPredicate<TType, TPredicate>(predicate))))
+                {
+                    if (fused != Impl_)
+                    {
+                        Clear();
+                        Impl_ = fused;
+                    }
+                }
+                else
+                {
+                    Impl_ = new TRemoveImpl_(Unbuffer(), predicate);
+                }
             }
         }
     };
 
+    // Transfers contents of range without cloning them, range is left empty
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Move(TRange<TType, TAssert>& range)
+    {
+        TRange<TType, TAssert> result;
+        result.Swap(range);
+        return result;
+    }
+
     template <class TType, class TAssert, class TCounter>
     static inline TRange<TType, TAssert> operator *(TRange<TType, TAssert> lhs,
         TCounter counter)
     {
         lhs *= counter;
-        return TRange<TType, TAssert>(lhs.Release());
+        return Move(lhs);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> operator +(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        lhs += TRange<TType, TAssert>(rhs.Release());
-        return TRange<TType, TAssert>(lhs.Release());
+        lhs += Move(rhs);
+        return Move(lhs);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> operator -(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        lhs -= TRange<TType, TAssert>(rhs.Release());
-        return TRange<TType, TAssert>(lhs.Release());
+        lhs -= Move(rhs);
+        return Move(lhs);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> operator |(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        lhs |= TRange<TType, TAssert>(rhs.Release());
-        return TRange<TType, TAssert>(lhs.Release());
+        lhs |= Move(rhs);
+        return Move(lhs);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> operator &(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        lhs &= TRange<TType, TAssert>(rhs.Release());
-        return TRange<TType, TAssert>(lhs.Release());
+        lhs &= Move(rhs);
+        return Move(lhs);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> operator ^(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        lhs ^= TRange<TType, TAssert>(rhs.Release());
-        return TRange<TType, TAssert>(lhs.Release());
+        lhs ^= Move(rhs);
+        return Move(lhs);
     }
 
     template <class TType, class TAssert, class TCompare>
@@ -348,17 +704,14 @@ namespace NRaingee
     static inline bool operator ==(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        return Equal(TRange<TType, TAssert>(lhs.Release()),
-            TRange<TType, TAssert>(rhs.Release()),
-            std::equal_to<TType>());
+        return Equal(Move(lhs), Move(rhs), std::equal_to<TType>());
     }
 
     template <class TType, class TAssert>
     static inline bool operator !=(TRange<TType, TAssert> lhs,
         TRange<TType, TAssert> rhs)
     {
-        return !(TRange<TType, TAssert>(lhs.Release())
-            == TRange<TType, TAssert>(rhs.Release()));
+        return !(Move(lhs) == Move(rhs));
     }
 
     template <class TType, class TAssert, class TCompare>
@@ -367,11 +720,13 @@ namespace NRaingee
     {
         while (!(lhs.IsEmpty() || rhs.IsEmpty()))
         {
-            if (compare(lhs.Front(), rhs.Front()))
+            const int order = TThreeWay<TCompare>::Compare(compare,
+                lhs.Front(), rhs.Front());
+            if (order < 0)
             {
                 lhs.Pop();
             }
-            else if (compare(rhs.Front(), lhs.Front()))
+            else if (order > 0)
             {
                 return false;
             }
@@ -389,9 +744,7 @@ namespace NRaingee
         TRange<TType, TAssert> rhs)
 
     {
-        typedef TRange<TType, TAssert> TRangeType;
-        return Includes(TRangeType(lhs.Release()), TRangeType(rhs.Release()),
-            std::less<TType>());
+        return Includes(Move(lhs), Move(rhs), std::less<TType>());
     }
 
     template <class TType, class TAssert, class TCompare>
@@ -399,118 +752,812 @@ namespace NRaingee
         TCompare compare)
     {
         range.Unique(compare);
-        return TRange<TType, TAssert>(range.Release());
+        return Move(range);
     }
 
     template <class TType, class TAssert>
     static inline TRange<TType, TAssert> Unique(TRange<TType, TAssert> range)
     {
-        return Unique(TRange<TType, TAssert>(range.Release()),
-            std::equal_to<TType>());
+        return Unique(Move(range), std::equal_to<TType>());
     }
 
-    template <class TType, class TAssert, class TPredicate>
-    static inline TRange<TType, TAssert> Remove(TRange<TType, TAssert> range,
-        TPredicate predicate)
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Adaptive(TRange<TType, TAssert> range,
+        unsigned threshold = 1)
     {
-        range.Remove(predicate);
-        return TRange<TType, TAssert>(range.Release());
+        range.Adapt(threshold);
+        return Move(range);
     }
 
-    template <class TType, class TOldType, class TAssert, class TUnaryOp>
-    static inline TRange<TType, TAssert> Transform(
-        TRange<TOldType, TAssert> range, TUnaryOp op)
+    template <class TType, class TAssert, class THashFunc, class TCompare>
+    static inline TRange<TType, TAssert> Distinct(TRange<TType, TAssert> range,
+        THashFunc hash, TCompare compare, std::size_t tableLimit)
     {
-        TRange<TType, TAssert> result;
-        if (!range.IsEmpty())
-        {
-            TRange<TType, TAssert>(
-                new TTransformedRangeImpl<TType, TOldType, TUnaryOp>(range,
-                    op)).Swap(result);
-        }
-        return result;
+        range.Distinct(hash, compare, tableLimit);
+        return Move(range);
     }
 
-    template <class TType, class TFirstType, class TSecondType, class TAssert,
-        class TBinaryOp>
-    static inline TRange<TType, TAssert> Transform(
-        TRange<TFirstType, TAssert> first,
-        TRange<TSecondType, TAssert> second,
-        TBinaryOp op)
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Distinct(TRange<TType, TAssert> range,
+        std::size_t tableLimit = 1 << 24)
     {
-        TRange<TType, TAssert> result;
-        if (!(first.IsEmpty() || second.IsEmpty()))
-        {
-            TRange<TType, TAssert>(new TTransformedRangesImpl<TType,
-                TFirstType, TSecondType, TBinaryOp>(first, second, op)).Swap(
-                    result);
-        }
-        return result;
+        range.Distinct(tableLimit);
+        return Move(range);
     }
 
-    template <class TType, class TInserter, class TDelimiter,
-        class TEscapeChar, class TOldType, class TAssert>
-    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
-        TDelimiter delimiter, TEscapeChar escapeChar)
+    template <class TType, class TAssert, class THashFunc, class TCompare>
+    static inline TRange<TType, TAssert> HashIntersect(
+        TRange<TType, TAssert> probe, TRange<TType, TAssert> build,
+        THashFunc hash, TCompare compare)
     {
-        TRange<TType, TAssert> result;
-        if (!range.IsEmpty())
+        probe.HashIntersect(Move(build), hash, compare);
+        return Move(probe);
+    }
+
+    // Builds hash table from the smaller range if sizes of both ranges can
+    // be estimated, so the result follows order of the larger one.
+    // Otherwise rhs is the build side.
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> HashIntersect(
+        TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs)
+    {
+        std::size_t lhsSize;
+        std::size_t rhsSize;
+        if (lhs.EstimateSize(lhsSize) && rhs.EstimateSize(rhsSize)
+            && lhsSize < rhsSize)
         {
-            TRange<TType, TAssert>(new TSplittedRangeImpl<TType, TInserter,
-                TDelimiter, TEscapeChar, TOldType>(range, delimiter,
-                    escapeChar)).Swap(result);
+            lhs.Swap(rhs);
         }
-        return result;
+        lhs.HashIntersect(Move(rhs),
+            THash<TType>(), std::less<TType>());
+        return Move(lhs);
     }
 
-    template <class TType, class TInserter, class TDelimiter, class TOldType,
-        class TAssert>
-    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
-        TDelimiter delimiter)
+    template <class TType, class TAssert, class THashFunc, class TCompare>
+    static inline TRange<TType, TAssert> HashComplement(
+        TRange<TType, TAssert> range, TRange<TType, TAssert> subtrahend,
+        THashFunc hash, TCompare compare)
     {
-        return Split<TType, TInserter, TDelimiter, TFakeEscapeChar, TOldType,
-            TAssert>(range, delimiter, TFakeEscapeChar());
+        range.HashComplement(Move(subtrahend), hash, compare);
+        return Move(range);
     }
 
-    template <class TType, class TDelimiter, class TEscapeChar, class TOldType,
-        class TAssert>
-    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
-        TDelimiter delimiter, TEscapeChar escapeChar)
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> HashComplement(
+        TRange<TType, TAssert> range, TRange<TType, TAssert> subtrahend)
     {
-        return Split<TType, std::back_insert_iterator<TType>, TDelimiter,
-            TEscapeChar, TOldType, TAssert>(range, delimiter, escapeChar);
+        range.HashComplement(Move(subtrahend),
+            THash<TType>(), std::less<TType>());
+        return Move(range);
     }
 
-    template <class TType, class TDelimiter, class TOldType, class TAssert>
-    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
-        TDelimiter delimiter)
+    // Makes range of data contents without copying them, data is left empty
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Adopt(std::vector<TType>& data)
     {
-        return Split<TType, TDelimiter, TFakeEscapeChar, TOldType, TAssert>(
-            range, delimiter, TFakeEscapeChar());
+        return TRange<TType, TAssert>(data.empty() ?
+            0 : TSequenceRangeImpl<TType>::Adopt(data));
+    }
+
+    template <class TType>
+    static inline TRange<TType> Adopt(std::vector<TType>& data)
+    {
+        return Adopt<TType, TEmptyAssert>(data);
     }
 
+#if __cplusplus >= 201103L
     template <class TType, class TAssert>
-    static inline typename TRange<TType, TAssert>::TSizeType_ Size(
-        TRange<TType, TAssert> range)
+    static inline TRange<TType, TAssert> Adopt(std::vector<TType>&& data)
     {
-        typedef typename TRange<TType, TAssert>::TSizeType_ TSizeType;
-        TSizeType result = TSizeType();
-        while (!range.IsEmpty())
-        {
-            ++result;
-            range.Pop();
-        }
-        return result;
+        return Adopt<TType, TAssert>(data);
+    }
+
+    template <class TType>
+    static inline TRange<TType> Adopt(std::vector<TType>&& data)
+    {
+        return Adopt<TType, TEmptyAssert>(data);
     }
+#endif
 
+    // Refers to [first, last) without copying, the buffer must outlive the
+    // range and all its copies
     template <class TType, class TAssert>
-    static inline void swap(TRange<TType, TAssert>& lhs,
-        TRange<TType, TAssert>& rhs)
+    static inline TRange<TType, TAssert> View(const TType* first,
+        const TType* last)
     {
-        lhs.Swap(rhs);
+        return TRange<TType, TAssert>(first == last ?
+            0 : TSequenceRangeImpl<TType>::View(first, last));
     }
 
-    // Complex ranges c'tors
+    template <class TType>
+    static inline TRange<TType> View(const TType* first, const TType* last)
+    {
+        return View<TType, TEmptyAssert>(first, last);
+    }
+
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Compact(TRange<TType, TAssert> range)
+    {
+        range.Compact();
+        return Move(range);
+    }
+
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Compile(TRange<TType, TAssert> range)
+    {
+        range.Compile();
+        return Move(range);
+    }
+
+    // Integers from [begin, end)
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Interval(TType begin, TType end)
+    {
+        typedef typename TIntervalRangeImpl<TType>::TRuns_ TRuns;
+        return TRange<TType, TAssert>(begin < end ?
+            new TIntervalRangeImpl<TType>(
+                TRuns(1, std::make_pair(begin, end))) : 0);
+    }
+
+    template <class TType>
+    static inline TRange<TType> Interval(TType begin, TType end)
+    {
+        return Interval<TType, TEmptyAssert>(begin, end);
+    }
+
+    // Union of [begin, end) runs given as pairs in any order
+    template <class TInputIterator, class TAssert>
+    static inline TRange<typename std::iterator_traits<
+        TInputIterator>::value_type::first_type, TAssert> Intervals(
+            TInputIterator first, TInputIterator last)
+    {
+        typedef typename std::iterator_traits<
+            TInputIterator>::value_type::first_type TType;
+        typename TIntervalRangeImpl<TType>::TRuns_ runs(first, last);
+        TIntervalRangeImpl<TType>::Normalize(runs);
+        return TRange<TType, TAssert>(runs.empty() ?
+            0 : new TIntervalRangeImpl<TType>(runs));
+    }
+
+    template <class TInputIterator>
+    static inline TRange<typename std::iterator_traits<
+        TInputIterator>::value_type::first_type> Intervals(
+            TInputIterator first, TInputIterator last)
+    {
+        return Intervals<TInputIterator, TEmptyAssert>(first, last);
+    }
+
+    // Estimates number of distinct elements in union of ranges using sketches
+    // only. Returns false if some range has no sketch attached.
+    template <class TType, class TAssert>
+    static inline bool EstimateUnionSize(
+        const std::vector<TRange<TType, TAssert> >& ranges, double& size)
+    {
+        TSketch sketch;
+        for (std::size_t i = 0; i < ranges.size(); ++i)
+        {
+            if (!ranges[i].MergeSketch(sketch))
+            {
+                return false;
+            }
+        }
+        size = sketch.EstimateSize();
+        return true;
+    }
+
+    template <class TType, class TAssert>
+    static inline bool EstimateIntersectionSize(
+        const std::vector<TRange<TType, TAssert> >& ranges, double& size)
+    {
+        std::vector<TSketch> sketches(ranges.size());
+        for (std::size_t i = 0; i < ranges.size(); ++i)
+        {
+            if (!ranges[i].MergeSketch(sketches[i]))
+            {
+                return false;
+            }
+        }
+        size = EstimateIntersectionSize(sketches);
+        return true;
+    }
+
+    // Elements found in at least k of sorted ranges, zero k is treated as one
+    template <class TType, class TAssert, class TCompare>
+    static inline TRange<TType, TAssert> Threshold(
+        const std::vector<TRange<TType, TAssert> >& ranges, std::size_t k,
+        TCompare compare)
+    {
+        return TRange<TType, TAssert>(
+            new TThresholdRangesImpl<TType, TCompare>(ranges.begin(),
+                ranges.end(), k, compare));
+    }
+
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> Threshold(
+        const std::vector<TRange<TType, TAssert> >& ranges, std::size_t k)
+    {
+        return Threshold(ranges, k, std::less<TType>());
+    }
+
+    // Elements of sorted range not found in any of sorted ranges, with the
+    // same handling of duplicates as range - (ranges[0] | ranges[1] | ...).
+    // Unlike it, ranges are advanced only as far as elements of range, so
+    // their other elements are skipped, not merged.
+    template <class TType, class TAssert, class TCompare>
+    static inline TRange<TType, TAssert> ComplementAll(
+        TRange<TType, TAssert> range,
+        const std::vector<TRange<TType, TAssert> >& ranges, TCompare compare)
+    {
+        TRange<TType, TAssert> result;
+        if (!range.IsEmpty())
+        {
+            TRange<TType, TAssert>(new TComplementAllImpl<TType, TCompare>(
+                range.Release(), ranges.begin(), ranges.end(),
+                compare)).Swap(result);
+        }
+        return result;
+    }
+
+    template <class TType, class TAssert>
+    static inline TRange<TType, TAssert> ComplementAll(
+        TRange<TType, TAssert> range,
+        const std::vector<TRange<TType, TAssert> >& ranges)
+    {
+        return ComplementAll(Move(range), ranges, std::less<TType>());
+    }
+
+    template <class TType, class TAssert, class TPredicate>
+    static inline TRange<TType, TAssert> Remove(TRange<TType, TAssert> range,
+        TPredicate predicate)
+    {
+        range.Remove(predicate);
+        return Move(range);
+    }
+
+    template <class TType, class TOldType, class TAssert, class TUnaryOp>
+    static inline TRange<TType, TAssert> Transform(
+        TRange<TOldType, TAssert> range, TUnaryOp op)
+    {
+        TRange<TType, TAssert> result;
+        if (!range.IsEmpty())
+        {
+            TRange<TType, TAssert>(
+                TTransformedRangeImpl<TType, TOldType, TUnaryOp>::Create(range,
+                    op)).Swap(result);
+        }
+        return result;
+    }
+
+    template <class TType, class TOldType, class TAssert, class TUnaryOp>
+    static inline TRange<TType, TAssert> CachedTransform(
+        TRange<TOldType, TAssert> range, TUnaryOp op)
+    {
+        TRange<TType, TAssert> result;
+        if (!range.IsEmpty())
+        {
+            TRange<TType, TAssert>(
+                new TCachedTransformedRangeImpl<TType, TOldType, TUnaryOp>(
+                    range, op)).Swap(result);
+        }
+        return result;
+    }
+
+    template <class TType, class TFirstType, class TSecondType, class TAssert,
+        class TBinaryOp>
+    static inline TRange<TType, TAssert> Transform(
+        TRange<TFirstType, TAssert> first,
+        TRange<TSecondType, TAssert> second,
+        TBinaryOp op)
+    {
+        TRange<TType, TAssert> result;
+        if (!(first.IsEmpty() || second.IsEmpty()))
+        {
+            TRange<TType, TAssert>(new TTransformedRangesImpl<TType,
+                TFirstType, TSecondType, TBinaryOp>(first, second, op)).Swap(
+                    result);
+        }
+        return result;
+    }
+
+    // N-ary Transform which advances all ranges in lockstep and calls op
+    // with pointer to values at the same position and their number. Ranges
+    // must be of the same type, since there are no variadic templates in
+    // C++03, nest binary Transform for ranges of different types.
+    template <class TType, class TOldType, class TAssert, class TOp>
+    static TRange<TType, TAssert> Transform(
+        std::vector<TRange<TOldType, TAssert> > ranges, TOp op)
+    {
+        TRange<TType, TAssert> result;
+        std::vector<IRangeImpl<TOldType>*> impls;
+        for (std::size_t i = 0; i < ranges.size(); ++i)
+        {
+            if (ranges[i].IsEmpty())
+            {
+                return result;
+            }
+        }
+        if (!ranges.empty())
+        {
+            impls.reserve(ranges.size());
+            for (std::size_t i = 0; i < ranges.size(); ++i)
+            {
+                impls.push_back(ranges[i].Release());
+            }
+            TRange<TType, TAssert>(
+                new TZippedRangesImpl<TType, TOldType, TOp>(impls, op)).Swap(
+                    result);
+        }
+        return result;
+    }
+
+    template <class TType, class TInserter, class TDelimiter,
+        class TEscapeChar, class TOldType, class TAssert>
+    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
+        TDelimiter delimiter, TEscapeChar escapeChar)
+    {
+        TRange<TType, TAssert> result;
+        if (!range.IsEmpty())
+        {
+            TRange<TType, TAssert>(new TSplittedRangeImpl<TType, TInserter,
+                TDelimiter, TEscapeChar, TOldType>(range, delimiter,
+                    escapeChar)).Swap(result);
+        }
+        return result;
+    }
+
+    template <class TType, class TInserter, class TDelimiter, class TOldType,
+        class TAssert>
+    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
+        TDelimiter delimiter)
+    {
+        return Split<TType, TInserter, TDelimiter, TFakeEscapeChar, TOldType,
+            TAssert>(range, delimiter, TFakeEscapeChar());
+    }
+
+    template <class TType, class TDelimiter, class TEscapeChar, class TOldType,
+        class TAssert>
+    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
+        TDelimiter delimiter, TEscapeChar escapeChar)
+    {
+        return Split<TType, std::back_insert_iterator<TType>, TDelimiter,
+            TEscapeChar, TOldType, TAssert>(range, delimiter, escapeChar);
+    }
+
+    template <class TType, class TDelimiter, class TOldType, class TAssert>
+    static inline TRange<TType, TAssert> Split(TRange<TOldType, TAssert> range,
+        TDelimiter delimiter)
+    {
+        return Split<TType, TDelimiter, TFakeEscapeChar, TOldType, TAssert>(
+            range, delimiter, TFakeEscapeChar());
+    }
+
+    template <class TType, class TAssert>
+    static inline typename TRange<TType, TAssert>::TSizeType_ Size(
+        TRange<TType, TAssert> range)
+    {
+        typedef typename TRange<TType, TAssert>::TSizeType_ TSizeType;
+        std::size_t size;
+        if (range.GetSize(size))
+        {
+            return size;
+        }
+        TSizeType result = TSizeType();
+        while (!range.IsEmpty())
+        {
+            ++result;
+            range.Pop();
+        }
+        return result;
+    }
+
+    // Terminals below pull range in blocks and run plain loops over them, so
+    // that contiguous leaves are copied in bulk and loops can be vectorized
+    template <class TType, class TAssert, class TResult, class TBinaryOp>
+    static TResult Reduce(TRange<TType, TAssert> range, TResult init,
+        TBinaryOp op)
+    {
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                init = op(init, data[i]);
+            }
+        }
+        return init;
+    }
+
+    template <class TType, class TAssert>
+    static inline TType Sum(TRange<TType, TAssert> range)
+    {
+        return Reduce(Move(range), TType(), std::plus<TType>());
+    }
+
+    // Returns the least element of non-empty range
+    template <class TType, class TAssert, class TCompare>
+    static TType Min(TRange<TType, TAssert> range, TCompare compare)
+    {
+        TAssert::Assert(Not(BindMember(&range,
+            &TRange<TType, TAssert>::IsEmpty)), "Min called on empty range");
+        TType result = range.Front();
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                if (compare(data[i], result))
+                {
+                    result = data[i];
+                }
+            }
+        }
+        return result;
+    }
+
+    template <class TType, class TAssert>
+    static inline TType Min(TRange<TType, TAssert> range)
+    {
+        return Min(Move(range), std::less<TType>());
+    }
+
+    // Returns the greatest element of non-empty range
+    template <class TType, class TAssert, class TCompare>
+    static TType Max(TRange<TType, TAssert> range, TCompare compare)
+    {
+        TAssert::Assert(Not(BindMember(&range,
+            &TRange<TType, TAssert>::IsEmpty)), "Max called on empty range");
+        TType result = range.Front();
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                if (compare(result, data[i]))
+                {
+                    result = data[i];
+                }
+            }
+        }
+        return result;
+    }
+
+    template <class TType, class TAssert>
+    static inline TType Max(TRange<TType, TAssert> range)
+    {
+        return Max(Move(range), std::less<TType>());
+    }
+
+    // Stops at the first block containing matching element
+    template <class TType, class TAssert, class TPredicate>
+    static bool Any(TRange<TType, TAssert> range, TPredicate predicate)
+    {
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                if (predicate(data[i]))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template <class TType, class TAssert, class TPredicate>
+    static bool All(TRange<TType, TAssert> range, TPredicate predicate)
+    {
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                if (!predicate(data[i]))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template <class TType, class TAssert, class TOutputIterator>
+    static TOutputIterator CopyTo(TRange<TType, TAssert> range,
+        TOutputIterator out)
+    {
+        TReadBlock<TType> block;
+        TType* data = block.Get();
+        std::size_t size;
+        while ((size = range.Read(data, TReadBlock<TType>::Size_)))
+        {
+            out = std::copy(data, data + size, out);
+        }
+        return out;
+    }
+
+    // Reduces range with associative op: chunks of range are pulled by the
+    // calling thread, and each chunk is reduced by threads concurrently
+    template <class TType, class TAssert, class TResult, class TBinaryOp>
+    static TResult ParallelReduce(TRange<TType, TAssert> range, TResult init,
+        TBinaryOp op, unsigned threads = HardwareThreads())
+    {
+        if (threads < 2 || range.IsEmpty())
+        {
+            return Reduce(Move(range), init, op);
+        }
+        // Chunk doesn't exceed range, if its size is known
+        std::size_t chunk = threads * 65536;
+        std::size_t estimate;
+        if (range.EstimateSize(estimate) && estimate && estimate < chunk)
+        {
+            chunk = estimate;
+        }
+        // Filled with copies of the front element, so that TType doesn't
+        // need default constructor
+        std::vector<TType> data(chunk, range.Front());
+        std::size_t size;
+        while ((size = range.Read(&data[0], chunk)))
+        {
+            init = op(init, ParallelReduce(&data[0] + 1, &data[0] + size,
+                TResult(data[0]), op, threads));
+        }
+        return init;
+    }
+
+    // Input iterator over copy of range. Elements are pulled in blocks, so
+    // that advancing costs a branch instead of virtual calls. Copies of
+    // iterator share position, as usual for input iterators.
+    template <class TType, class TAssert>
+    class TRangeIterator
+    {
+        struct TState_
+        {
+            TRange<TType, TAssert> Range_;
+            TReadBlock<TType> Block_;
+            const TType* Begin_;
+            const TType* End_;
+            unsigned Counter_;
+
+            inline explicit TState_(const TRange<TType, TAssert>& range)
+                : Range_(range)
+                , Counter_(1)
+            {
+                Fetch();
+            }
+
+            inline void Fetch()
+            {
+                TType* data = Block_.Get();
+                Begin_ = data;
+                End_ = data + Range_.Read(data, TReadBlock<TType>::Size_);
+            }
+        };
+
+        // Keeps value for postfix increment
+        class TValue_
+        {
+            const TType Value_;
+
+        public:
+            inline explicit TValue_(const TType& value)
+                : Value_(value)
+            {
+            }
+
+            inline const TType& operator *() const
+            {
+                return Value_;
+            }
+        };
+
+        TState_* State_;
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef TType value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const TType* pointer;
+        typedef const TType& reference;
+
+        // Past the end iterator
+        inline TRangeIterator()
+            : State_(0)
+        {
+        }
+
+        inline explicit TRangeIterator(const TRange<TType, TAssert>& range)
+            : State_(new TState_(range))
+        {
+        }
+
+        inline TRangeIterator(const TRangeIterator& iterator)
+            : State_(iterator.State_)
+        {
+            if (State_)
+            {
+                ++State_->Counter_;
+            }
+        }
+
+        inline TRangeIterator& operator =(TRangeIterator iterator)
+        {
+            std::swap(State_, iterator.State_);
+            return *this;
+        }
+
+        inline ~TRangeIterator()
+        {
+            if (State_ && !--State_->Counter_)
+            {
+                delete State_;
+            }
+        }
+
+        inline bool IsEnd() const
+        {
+            return !State_ || State_->Begin_ == State_->End_;
+        }
+
+        inline const TType& operator *() const
+        {
+            return *State_->Begin_;
+        }
+
+        inline const TType* operator ->() const
+        {
+            return State_->Begin_;
+        }
+
+        inline TRangeIterator& operator ++()
+        {
+            if (++State_->Begin_ == State_->End_)
+            {
+                State_->Fetch();
+            }
+            return *this;
+        }
+
+        inline TValue_ operator ++(int)
+        {
+            TValue_ result(*State_->Begin_);
+            ++*this;
+            return result;
+        }
+
+        inline bool operator ==(const TRangeIterator& iterator) const
+        {
+            return State_ == iterator.State_
+                || (IsEnd() && iterator.IsEnd());
+        }
+
+        inline bool operator !=(const TRangeIterator& iterator) const
+        {
+            return !(*this == iterator);
+        }
+    };
+
+    // Lower case names are found by range-based for and std::begin()
+    template <class TType, class TAssert>
+    static inline TRangeIterator<TType, TAssert> begin(
+        const TRange<TType, TAssert>& range)
+    {
+        return TRangeIterator<TType, TAssert>(range);
+    }
+
+    template <class TType, class TAssert>
+    static inline TRangeIterator<TType, TAssert> end(
+        const TRange<TType, TAssert>&)
+    {
+        return TRangeIterator<TType, TAssert>();
+    }
+
+    // Counts elements of set operation over two ranges. Only operations over
+    // two sequences are counted without copying elements, by merging their
+    // underlying data, and intervals are counted by runs. Nested operations
+    // are popped element by element, as Size() does.
+    template <class TType, class TAssert, class TCompare>
+    static inline typename TRange<TType, TAssert>::TSizeType_
+    CountIntersection(TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs,
+        TCompare compare)
+    {
+        lhs.Intersect(Move(rhs), compare);
+        return Size(Move(lhs));
+    }
+
+    template <class TType, class TAssert>
+    static inline typename TRange<TType, TAssert>::TSizeType_
+    CountIntersection(TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs)
+    {
+        return CountIntersection(Move(lhs), Move(rhs), std::less<TType>());
+    }
+
+    template <class TType, class TAssert, class TCompare>
+    static inline typename TRange<TType, TAssert>::TSizeType_ CountUnion(
+        TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs,
+        TCompare compare)
+    {
+        lhs.Unite(Move(rhs), compare);
+        return Size(Move(lhs));
+    }
+
+    template <class TType, class TAssert>
+    static inline typename TRange<TType, TAssert>::TSizeType_ CountUnion(
+        TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs)
+    {
+        return CountUnion(Move(lhs), Move(rhs), std::less<TType>());
+    }
+
+    template <class TType, class TAssert, class TCompare>
+    static inline typename TRange<TType, TAssert>::TSizeType_
+    CountDifference(TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs,
+        TCompare compare)
+    {
+        lhs.Complement(Move(rhs), compare);
+        return Size(Move(lhs));
+    }
+
+    template <class TType, class TAssert>
+    static inline typename TRange<TType, TAssert>::TSizeType_
+    CountDifference(TRange<TType, TAssert> lhs, TRange<TType, TAssert> rhs)
+    {
+        return CountDifference(Move(lhs), Move(rhs), std::less<TType>());
+    }
+
+    // Checks that range has at least count elements, popping no more than
+    // count elements. GetSize() isn't used, since it merges set operations
+    // in full.
+    template <class TType, class TAssert>
+    static inline bool AtLeast(TRange<TType, TAssert> range,
+        typename TRange<TType, TAssert>::TSizeType_ count)
+    {
+        std::size_t size;
+        if (range.GetKnownSize(size)
+            || (range.EstimateSize(size) && size < count))
+        {
+            return size >= count;
+        }
+        for (; count && !range.IsEmpty(); --count)
+        {
+            range.Pop();
+        }
+        return !count;
+    }
+
+    // Stops at the first common element
+    template <class TType, class TAssert, class TCompare>
+    static inline bool IsDisjoint(TRange<TType, TAssert> lhs,
+        TRange<TType, TAssert> rhs, TCompare compare)
+    {
+        lhs.Intersect(Move(rhs), compare);
+        return lhs.IsEmpty();
+    }
+
+    template <class TType, class TAssert>
+    static inline bool IsDisjoint(TRange<TType, TAssert> lhs,
+        TRange<TType, TAssert> rhs)
+    {
+        return IsDisjoint(Move(lhs), Move(rhs), std::less<TType>());
+    }
+
+    template <class TType, class TAssert>
+    static inline void swap(TRange<TType, TAssert>& lhs,
+        TRange<TType, TAssert>& rhs)
+    {
+        lhs.Swap(rhs);
+    }
+
+    // Complex ranges c'tors
     template <class TType, class TCounter>
     template <class TAssert>
     TRepeatedRangeImpl<TType, TCounter>::TRepeatedRangeImpl(
@@ -539,6 +1586,7 @@ namespace NRaingee
         , Second_(second.Release())
         , ActiveRange_(First_)
     {
+        FindBounds();
     }
 
     template <class TType>
@@ -549,6 +1597,7 @@ namespace NRaingee
         , Second_(second.Release())
         , ActiveRange_(First_)
     {
+        FindBounds();
     }
 
     template <class TType>
@@ -575,6 +1624,10 @@ namespace NRaingee
         : First_(first)
         , Second_(second.Release())
         , Compare_(compare)
+        , Operands_(CombineFingerprints(First_.Get()->Fingerprint(),
+            Second_.Get()->Fingerprint()))
+        , Identity_(First_.Get(), Second_.Get())
+        , Bounds_(First_.Get())
     {
         Next();
     }
@@ -588,22 +1641,36 @@ namespace NRaingee
         : First_(first.Release())
         , Second_(second.Release())
         , Compare_(compare)
+        , Operands_(CombineFingerprints(First_.Get()->Fingerprint(),
+            Second_.Get()->Fingerprint()))
+        , Identity_(First_.Get(), Second_.Get())
+        , Bounds_(First_.Get())
     {
         Next();
     }
 
     template <class TType, class TCompare>
-    IRangeImpl<TType>* TComplementedRangesImpl<TType, TCompare>::Clone() const
+    IRangeImpl<TType>* TComplementedRangesImpl<TType, TCompare>::Copy(
+        TArena* arena) const
     {
-        if (Second_->IsEmpty())
+        if (Second_.IsEmpty())
         {
-            return First_->Clone();
+            return First_.Clone(arena);
         }
         else
         {
-            TRange<TType, TEmptyAssert> first(First_->Clone());
-            TRange<TType, TEmptyAssert> second(Second_->Clone());
-            return new TComplementedRangesImpl(first, second, Compare_);
+            TRange<TType, TEmptyAssert> first(First_.Clone(arena));
+            TRange<TType, TEmptyAssert> second(Second_.Clone(arena));
+            TComplementedRangesImpl* result = arena
+                ? new (*arena) TArenaAllocated<TComplementedRangesImpl>(first,
+                    second, Compare_)
+                : new TComplementedRangesImpl(first, second, Compare_);
+            if (Operands_)
+            {
+                result->Operands_ = Operands_;
+                result->Identity_ = Identity_;
+            }
+            return result;
         }
     }
 
@@ -615,12 +1682,14 @@ namespace NRaingee
         TCompare compare)
         : First_(first)
         , Second_(second.Release())
-        , ActiveRange_(Compare_(First_->Front(), Second_->Front()) ?
-            First_ : Second_)
         , Compare_(compare)
-        , PopBoth_(ActiveRange_ == Second_
-            && !Compare_(Second_->Front(), First_->Front()))
+        , Operands_(OperandsFingerprint<TUnitedRangesImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TUnitedRangesImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
+        Next();
     }
 
     template <class TType, class TCompare>
@@ -631,30 +1700,42 @@ namespace NRaingee
         TCompare compare)
         : First_(first.Release())
         , Second_(second.Release())
-        , ActiveRange_(Compare_(First_->Front(), Second_->Front()) ?
-            First_ : Second_)
         , Compare_(compare)
-        , PopBoth_(ActiveRange_ == Second_
-            && !Compare_(Second_->Front(), First_->Front()))
+        , Operands_(OperandsFingerprint<TUnitedRangesImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TUnitedRangesImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
+        Next();
     }
 
     template <class TType, class TCompare>
-    IRangeImpl<TType>* TUnitedRangesImpl<TType, TCompare>::Clone() const
+    IRangeImpl<TType>* TUnitedRangesImpl<TType, TCompare>::Copy(
+        TArena* arena) const
     {
-        if (First_->IsEmpty())
+        if (First_.IsEmpty())
         {
-            return Second_->Clone();
+            return Second_.Clone(arena);
         }
-        else if (Second_->IsEmpty())
+        else if (Second_.IsEmpty())
         {
-            return First_->Clone();
+            return First_.Clone(arena);
         }
         else
         {
-            TRange<TType, TEmptyAssert> first(First_->Clone());
-            TRange<TType, TEmptyAssert> second(Second_->Clone());
-            return new TUnitedRangesImpl(first, second, Compare_);
+            TRange<TType, TEmptyAssert> first(First_.Clone(arena));
+            TRange<TType, TEmptyAssert> second(Second_.Clone(arena));
+            TUnitedRangesImpl* result = arena
+                ? new (*arena) TArenaAllocated<TUnitedRangesImpl>(first,
+                    second, Compare_)
+                : new TUnitedRangesImpl(first, second, Compare_);
+            if (Operands_)
+            {
+                result->Operands_ = Operands_;
+                result->Identity_ = Identity_;
+            }
+            return result;
         }
     }
 
@@ -667,7 +1748,12 @@ namespace NRaingee
         : First_(first)
         , Second_(second.Release())
         , Compare_(compare)
+        , Operands_(OperandsFingerprint<TIntersectedRangesImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TIntersectedRangesImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
         Next();
     }
 
@@ -680,16 +1766,31 @@ namespace NRaingee
         : First_(first.Release())
         , Second_(second.Release())
         , Compare_(compare)
+        , Operands_(OperandsFingerprint<TIntersectedRangesImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TIntersectedRangesImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
         Next();
     }
 
     template <class TType, class TCompare>
-    IRangeImpl<TType>* TIntersectedRangesImpl<TType, TCompare>::Clone() const
+    IRangeImpl<TType>* TIntersectedRangesImpl<TType, TCompare>::Copy(
+        TArena* arena) const
     {
-        TRange<TType, TEmptyAssert> first(First_->Clone());
-        TRange<TType, TEmptyAssert> second(Second_->Clone());
-        return new TIntersectedRangesImpl(first, second, Compare_);
+        TRange<TType, TEmptyAssert> first(First_.Clone(arena));
+        TRange<TType, TEmptyAssert> second(Second_.Clone(arena));
+        TIntersectedRangesImpl* result = arena
+            ? new (*arena) TArenaAllocated<TIntersectedRangesImpl>(first,
+                second, Compare_)
+            : new TIntersectedRangesImpl(first, second, Compare_);
+        if (Operands_)
+        {
+            result->Operands_ = Operands_;
+            result->Identity_ = Identity_;
+        }
+        return result;
     }
 
     template <class TType, class TCompare>
@@ -700,9 +1801,14 @@ namespace NRaingee
         TCompare compare)
         : First_(first)
         , Second_(second.Release())
-        , ActiveRange_(Next())
         , Compare_(compare)
+        , Operands_(OperandsFingerprint<TSymmetricDifferenceImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TSymmetricDifferenceImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
+        ActiveRange_ = Next();
     }
 
     template <class TType, class TCompare>
@@ -713,30 +1819,91 @@ namespace NRaingee
         TCompare compare)
         : First_(first.Release())
         , Second_(second.Release())
-        , ActiveRange_(Next())
         , Compare_(compare)
+        , Operands_(OperandsFingerprint<TSymmetricDifferenceImpl>(
+            First_.Get(), Second_.Get()))
+        , Identity_(CaptureOperands<TSymmetricDifferenceImpl>(
+            First_.Get(), Second_.Get()))
     {
+        FindBounds();
+        ActiveRange_ = Next();
     }
 
     template <class TType, class TCompare>
-    IRangeImpl<TType>* TSymmetricDifferenceImpl<TType, TCompare>::Clone() const
+    IRangeImpl<TType>* TSymmetricDifferenceImpl<TType, TCompare>::Copy(
+        TArena* arena) const
     {
-        if (First_->IsEmpty())
+        if (First_.IsEmpty())
         {
-            return Second_->Clone();
+            return Second_.Clone(arena);
         }
-        else if (Second_->IsEmpty())
+        else if (Second_.IsEmpty())
         {
-            return First_->Clone();
+            return First_.Clone(arena);
         }
         else
         {
-            TRange<TType, TEmptyAssert> first(First_->Clone());
-            TRange<TType, TEmptyAssert> second(Second_->Clone());
-            return new TSymmetricDifferenceImpl(first, second, Compare_);
+            TRange<TType, TEmptyAssert> first(First_.Clone(arena));
+            TRange<TType, TEmptyAssert> second(Second_.Clone(arena));
+            TSymmetricDifferenceImpl* result = arena
+                ? new (*arena) TArenaAllocated<TSymmetricDifferenceImpl>(first,
+                    second, Compare_)
+                : new TSymmetricDifferenceImpl(first, second, Compare_);
+            if (Operands_)
+            {
+                result->Operands_ = Operands_;
+                result->Identity_ = Identity_;
+            }
+            return result;
         }
     }
 
+    template <class TType, class TCompare>
+    template <class TInputIterator>
+    TThresholdRangesImpl<TType, TCompare>::TThresholdRangesImpl(
+        TInputIterator first, TInputIterator last, std::size_t k,
+        TCompare compare)
+        : K_(k ? k : 1)
+        , Compare_(compare)
+        , Front_()
+        , Empty_(false)
+    {
+        for (; first != last; ++first)
+        {
+            if (!first->IsEmpty())
+            {
+                typename std::iterator_traits<TInputIterator>::value_type
+                    range(*first);
+                Heads_.push_back(0);
+                Heads_.back() = new TRangeHead<TType>(range.Release());
+            }
+        }
+        std::sort(Heads_.begin(), Heads_.end(), THeadLess_(Compare_));
+        Next();
+    }
+
+    template <class TType, class TCompare>
+    template <class TInputIterator>
+    TComplementAllImpl<TType, TCompare>::TComplementAllImpl(
+        IRangeImpl<TType>* range, TInputIterator first, TInputIterator last,
+        TCompare compare)
+        : Range_(range)
+        , Compare_(compare)
+    {
+        for (; first != last; ++first)
+        {
+            if (!first->IsEmpty())
+            {
+                typename std::iterator_traits<TInputIterator>::value_type
+                    exclusion(*first);
+                Heads_.push_back(0);
+                Heads_.back() = new TRangeHead<TType>(exclusion.Release());
+            }
+        }
+        std::make_heap(Heads_.begin(), Heads_.end(), THeadGreater_(Compare_));
+        Next();
+    }
+
     template <class TType, class TCompare>
     template <class TAssert>
     TUniqueRangeImpl<TType, TCompare>::TUniqueRangeImpl(
@@ -749,10 +1916,52 @@ namespace NRaingee
     template <class TType, class TCompare>
     IRangeImpl<TType>* TUniqueRangeImpl<TType, TCompare>::Clone() const
     {
-        TRange<TType, TEmptyAssert> range(Range_->Clone());
+        TRange<TType, TEmptyAssert> range(Range_.Clone());
         return new TUniqueRangeImpl(range, Compare_);
     }
 
+    template <class TType, class THashFunc, class TCompare>
+    template <class TAssert>
+    TDistinctRangeImpl<TType, THashFunc, TCompare>::TDistinctRangeImpl(
+        TRange<TType, TAssert>& range, const TDistinctRangeImpl& state)
+        : Range_(range.Release())
+        , Seen_(state.Seen_)
+        , Runs_(state.Runs_)
+        , Compare_(state.Compare_)
+        , TableLimit_(state.TableLimit_)
+    {
+        for (std::size_t i = 0; i < Runs_.size(); ++i)
+        {
+            Runs_[i]->IncreaseCounter();
+        }
+    }
+
+    template <class TType, class THashFunc, class TCompare>
+    IRangeImpl<TType>*
+    TDistinctRangeImpl<TType, THashFunc, TCompare>::Clone() const
+    {
+        TRange<TType, TEmptyAssert> range(Range_.Clone());
+        return new TDistinctRangeImpl(range, *this);
+    }
+
+    template <class TType, class THashFunc, class TCompare>
+    template <class TAssert>
+    THashJoinImpl<TType, THashFunc, TCompare>::THashJoinImpl(
+        TRange<TType, TAssert>& probe, const THashJoinImpl& join)
+        : Table_(join.Table_)
+        , Probe_(probe.Release())
+        , Matching_(join.Matching_)
+    {
+        Table_->IncreaseCounter();
+    }
+
+    template <class TType, class THashFunc, class TCompare>
+    IRangeImpl<TType>* THashJoinImpl<TType, THashFunc, TCompare>::Clone() const
+    {
+        TRange<TType, TEmptyAssert> probe(Probe_.Clone());
+        return new THashJoinImpl(probe, *this);
+    }
+
     template <class TType, class TPredicate>
     template <class TAssert>
     TRemoveImpl<TType, TPredicate>::TRemoveImpl(
@@ -767,7 +1976,9 @@ namespace NRaingee
     IRangeImpl<TType>* TRemoveImpl<TType, TPredicate>::Clone() const
     {
         TRange<TType, TEmptyAssert> range(Range_->Clone());
-        return new TRemoveImpl(range, Predicate_);
+        TRemoveImpl* result = new TRemoveImpl(range, Predicate_);
+        result->Fused_ = Fused_;
+        return result;
     }
 
     template <class TType, class TOldType, class TUnaryOp>
@@ -779,12 +1990,52 @@ namespace NRaingee
     {
     }
 
+    template <class TType, class TOldType, class TUnaryOp>
+    template <class TAssert>
+    IRangeImpl<TType>*
+    TTransformedRangeImpl<TType, TOldType, TUnaryOp>::Create(
+        TRange<TOldType, TAssert>& range, TUnaryOp op)
+    {
+        IRangeImpl<TOldType>* impl = range.Release();
+        TTransformedRangeImpl* transform =
+            dynamic_cast<TTransformedRangeImpl*>(impl);
+        if (transform)
+        {
+            transform->Fused_.Add(op);
+            return transform;
+        }
+        TRange<TOldType, TAssert> restored(impl);
+        return new TTransformedRangeImpl(restored, op);
+    }
+
     template <class TType, class TOldType, class TUnaryOp>
     IRangeImpl<TType>*
     TTransformedRangeImpl<TType, TOldType, TUnaryOp>::Clone() const
     {
         TRange<TOldType, TEmptyAssert> range(Range_->Clone());
-        return new TTransformedRangeImpl(range, Op_);
+        TTransformedRangeImpl* result = new TTransformedRangeImpl(range, Op_);
+        result->Fused_ = Fused_;
+        return result;
+    }
+
+    template <class TType, class TOldType, class TUnaryOp>
+    template <class TAssert>
+    TCachedTransformedRangeImpl<TType, TOldType, TUnaryOp>::
+        TCachedTransformedRangeImpl(TRange<TOldType, TAssert>& range,
+            TUnaryOp op)
+        : Range_(range.Release())
+        , Op_(op)
+        , Value_()
+        , Cached_(false)
+    {
+    }
+
+    template <class TType, class TOldType, class TUnaryOp>
+    IRangeImpl<TType>*
+    TCachedTransformedRangeImpl<TType, TOldType, TUnaryOp>::Clone() const
+    {
+        TRange<TOldType, TEmptyAssert> range(Range_->Clone());
+        return new TCachedTransformedRangeImpl(range, Op_);
     }
 
     template <class TType, class TFirstType, class TSecondType,
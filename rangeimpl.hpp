@@ -20,561 +20,4213 @@
 #ifndef __RANGEIMPL_HPP_2012_01_31__
 #define __RANGEIMPL_HPP_2012_01_31__
 
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <typeinfo>
+#include <utility>
 #include <vector>
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#endif
+
+#include "arena.hpp"
+#include "compare.hpp"
+#include "hash.hpp"
+#include "sketch.hpp"
 
 namespace NRaingee
 {
     template <class TType, class TAssert>
     class TRange;
 
+    // Space for small range implementations stored inside of TRange, so
+    // that leaf ranges and their copies don't allocate
+    union TRangeBuffer
+    {
+        char Data_[4 * sizeof(void*)];
+        void* Pointer_;
+        long double Float_;
+    };
+
+    // Space for value which is constructed and destroyed by its owner, so
+    // that TType doesn't need default constructor
     template <class TType>
-    class IRangeImpl
+    union TValueStorage
     {
-        IRangeImpl(const IRangeImpl&);
-        IRangeImpl& operator =(const IRangeImpl&);
+        char Data_[sizeof(TType)];
+        void* Pointer_;
+        long double Float_;
 
-    public:
-        inline IRangeImpl()
+        inline TType& Get()
         {
+            return *reinterpret_cast<TType*>(Data_);
         }
 
-        virtual inline ~IRangeImpl()
+        inline const TType& Get() const
         {
+            return *reinterpret_cast<const TType*>(Data_);
         }
-
-        virtual bool IsEmpty() const = 0;
-        virtual void Pop() = 0 ;
-        virtual TType Front() const = 0;
-        virtual IRangeImpl* Clone() const = 0;
     };
 
     template <class TType>
-    class TSequenceRangeImpl: public IRangeImpl<TType>
-    {
-        typedef std::vector<TType> TData_;
+    class TProgram;
 
-        class TSharedStorage_
+    // Type erased predicate of filters fused into other nodes
+    template <class TType>
+    class IPredicate
+    {
+    public:
+        virtual inline ~IPredicate()
         {
-            const TData_ Data_;
-            unsigned Counter_;
+        }
 
-        public:
-            inline TSharedStorage_(TData_ data)
-                : Data_(data)
-                , Counter_(1)
-            {
-            }
+        virtual bool operator ()(const TType& value) = 0;
+        virtual IPredicate* Clone() const = 0;
+    };
 
-            inline void IncreaseCounter()
-            {
-                ++Counter_;
-            }
+    template <class TType, class TPredicate>
+    class TErasedPredicate: public IPredicate<TType>
+    {
+        TPredicate Predicate_;
 
-            inline unsigned DecreaseCounter()
-            {
-                return --Counter_;
-            }
+    public:
+        inline explicit TErasedPredicate(TPredicate predicate)
+            : Predicate_(predicate)
+        {
+        }
 
-            inline const TData_& GetData() const
-            {
-                return Data_;
-            }
-        };
+        inline bool operator ()(const TType& value)
+        {
+            return Predicate_(value);
+        }
 
-        TSharedStorage_* const Storage_;
-        typename TData_::const_iterator Begin_;
-        const typename TData_::const_iterator End_;
+        inline IPredicate<TType>* Clone() const
+        {
+            return new TErasedPredicate(Predicate_);
+        }
+    };
 
-        static TData_ ConvertToSequence(IRangeImpl<TType>* range)
+    template <class TType>
+    class IRangeImpl
+    {
+        IRangeImpl(const IRangeImpl&);
+        IRangeImpl& operator =(const IRangeImpl&);
+
+    public:
+        inline IRangeImpl()
         {
-            TData_ result;
-            while (!range->IsEmpty())
-            {
-                result.push_back(range->Front());
-                range->Pop();
-            }
-            return result;
         }
 
-        inline TSequenceRangeImpl(const TSequenceRangeImpl* range)
-            : Storage_(range->Storage_)
-            , Begin_(range->Begin_)
-            , End_(range->End_)
+        virtual inline ~IRangeImpl()
         {
-            Storage_->IncreaseCounter();
         }
 
-    public:
-        typedef typename TData_::size_type TSizeType_;
+        virtual bool IsEmpty() const = 0;
+        virtual void Pop() = 0 ;
+        virtual TType Front() const = 0;
+        virtual IRangeImpl* Clone() const = 0;
 
-        inline TSequenceRangeImpl(IRangeImpl<TType>* range)
-            : Storage_(new TSharedStorage_(TData_(ConvertToSequence(range))))
-            , Begin_(Storage_->GetData().begin())
-            , End_(Storage_->GetData().end())
+        // Constructs copy in buffer if implementation fits into it,
+        // otherwise on heap
+        virtual inline IRangeImpl* CloneTo(TRangeBuffer&) const
         {
-            delete range;
+            return Clone();
         }
 
-        inline TSequenceRangeImpl(TSizeType_ size, const TType& value)
-            : Storage_(new TSharedStorage_(TData_(size, value)))
-            , Begin_(Storage_->GetData().begin())
-            , End_(Storage_->GetData().end())
+        // Constructs copy with nodes allocated from arena, where
+        // implementations support it, otherwise on heap
+        virtual inline IRangeImpl* CloneTo(TArena&) const
         {
+            return Clone();
         }
 
-        template <class TInputIterator>
-        inline TSequenceRangeImpl(TInputIterator first, TInputIterator last)
-            : Storage_(new TSharedStorage_(TData_(first, last)))
-            , Begin_(Storage_->GetData().begin())
-            , End_(Storage_->GetData().end())
+        // Same as CloneTo, but may leave this implementation good for
+        // destruction only. Null buffer stands for heap.
+        virtual inline IRangeImpl* MoveTo(TRangeBuffer* buffer)
         {
+            return buffer ? CloneTo(*buffer) : Clone();
         }
 
-        inline ~TSequenceRangeImpl()
+        // Structural hash of range expression, zero stands for unknown
+        virtual inline TFingerprint Fingerprint() const
         {
-            if (!Storage_->DecreaseCounter())
-            {
-                delete Storage_;
-            }
+            return 0;
         }
 
-        inline bool IsEmpty() const
+        // Checks that range is the same expression, which fingerprints of
+        // both ranges can only suggest. False stands for unknown.
+        virtual inline bool IsSameExpression(const IRangeImpl&) const
         {
-            return Begin_ == End_;
+            return false;
         }
 
-        inline void Pop()
+        // Sets size to upper bound of the number of remaining elements, if
+        // it can be estimated without iterating
+        virtual inline bool EstimateSize(std::size_t&) const
         {
-            ++Begin_;
+            return false;
         }
 
-        inline TType Front() const
+        // Sets size to the exact number of remaining elements, if it can be
+        // found without popping elements one by one
+        virtual inline bool GetSize(std::size_t&) const
         {
-            return *Begin_;
+            return false;
         }
 
-        inline IRangeImpl<TType>* Clone() const
+        // Same as GetSize, but only for ranges which know their size without
+        // walking their elements, like leaves, so that it is cheaper than
+        // popping any number of elements
+        virtual inline bool GetKnownSize(std::size_t&) const
         {
-            return new TSequenceRangeImpl(this);
+            return false;
         }
-    };
 
-    template <class TType>
-    class TSingleValueRangeImpl: public IRangeImpl<TType>
-    {
-        const TType Value_;
-        bool Empty_;
+        // Sets first and last to the first and the last remaining elements of
+        // sorted range, or to bounds of them in the range order. Returns false
+        // if bounds are unknown or the range is empty.
+        virtual inline bool GetBounds(TType&, TType&) const
+        {
+            return false;
+        }
 
-    public:
-        inline explicit TSingleValueRangeImpl(const TType& value)
-            : Value_(value)
-            , Empty_(false)
+        // Merges sketch of the set of remaining elements into sketch,
+        // returns false if the range has no sketch attached
+        virtual inline bool MergeSketch(TSketch&) const
         {
+            return false;
         }
 
-        inline bool IsEmpty() const
+        // Appends instructions which evaluate remaining elements to program,
+        // the last of them holds the result. Returns false if the range
+        // can't be compiled.
+        virtual inline bool Compile(TProgram<TType>&) const
         {
-            return Empty_;
+            return false;
         }
 
-        inline void Pop()
+        // Pops up to size elements into buffer and returns their number, which
+        // is less than size only if range is exhausted. Leaves override it
+        // with plain loops over their data.
+        virtual std::size_t Read(TType* buffer, std::size_t size)
         {
-            Empty_ = true;
+            std::size_t count = 0;
+            for (; count < size && !IsEmpty(); ++count)
+            {
+                buffer[count] = Front();
+                Pop();
+            }
+            return count;
         }
 
-        inline TType Front() const
+        // Resets state to that of source, which must be of the same structure,
+        // like range this one was cloned from, so that nodes are reused
+        // instead of being cloned anew. Function objects are kept as they
+        // are. Returns false if not supported, leaving range good for
+        // destruction only. Use RewindRange(), which checks node types.
+        virtual inline bool Rewind(const IRangeImpl&)
         {
-            return Value_;
+            return false;
         }
 
-        inline IRangeImpl<TType>* Clone() const
+        // Returns range without elements matching predicate, which may be
+        // this node itself. Returns null if predicate can't be fused in,
+        // otherwise this node must be only destroyed afterwards.
+        virtual inline IRangeImpl* FuseFilter(const IPredicate<TType>&)
         {
-            return new TSingleValueRangeImpl(Value_);
+            return 0;
         }
     };
 
-    template <class TType, class TCounter>
-    class TRepeatedRangeImpl: public IRangeImpl<TType>
+    template <class TType>
+    static inline bool RewindRange(IRangeImpl<TType>* range,
+        const IRangeImpl<TType>& source)
     {
-        const IRangeImpl<TType>* const Range_;
-        IRangeImpl<TType>* CurrentRange_;
-        TCounter Counter_;
+        return typeid(*range) == typeid(source) && range->Rewind(source);
+    }
 
-        template <class TAssert>
-        TRepeatedRangeImpl(TRange<TType, TAssert>& range,
-            TRange<TType, TAssert>& current, TCounter counter);
+    // Scratch array for block pulls, allocated on first use
+    template <class TType>
+    class TReadBlock
+    {
+        TType* Data_;
+
+        TReadBlock(const TReadBlock&);
+        TReadBlock& operator =(const TReadBlock&);
 
     public:
-        inline TRepeatedRangeImpl(const IRangeImpl<TType>* range,
-            TCounter counter)
-            : Range_(range)
-            , CurrentRange_(Range_->Clone())
-            , Counter_(counter)
-        {
-            --Counter_;
-        }
+        static const std::size_t Size_ = 256;
 
-        inline ~TRepeatedRangeImpl()
+        inline TReadBlock()
+            : Data_(0)
         {
-            delete CurrentRange_;
-            delete Range_;
         }
 
-        inline bool IsEmpty() const
+        inline ~TReadBlock()
         {
-            return CurrentRange_->IsEmpty() && !Counter_;
+            delete[] Data_;
         }
 
-        inline void Pop()
+        inline TType* Get()
         {
-            CurrentRange_->Pop();
-            if (CurrentRange_->IsEmpty() && !!Counter_)
+            if (!Data_)
             {
-                delete CurrentRange_;
-                CurrentRange_ = Range_->Clone();
-                --Counter_;
+                Data_ = new TType[Size_];
             }
+            return Data_;
         }
+    };
 
-        inline TType Front() const
+    // Set operations as membership tables: bit (lhs + 2 * rhs) is set if
+    // value found in lhs and rhs as specified belongs to the result
+    struct TSetOperation
+    {
+        enum
         {
-            return CurrentRange_->Front();
-        }
-
-        IRangeImpl<TType>* Clone() const;
+            Difference_ = 2,
+            SymmetricDifference_ = 6,
+            Intersection_ = 8,
+            Union_ = 14
+        };
     };
 
-    struct TInfiniteCounter
+    template <class TType>
+    static inline bool EstimateSum(const IRangeImpl<TType>* first,
+        const IRangeImpl<TType>* second, std::size_t& size)
     {
-        inline bool operator !() const
+        std::size_t rhs;
+        if (first->EstimateSize(size) && second->EstimateSize(rhs))
         {
-            return false;
+            size += rhs;
+            return true;
         }
+        return false;
+    }
 
-        inline TInfiniteCounter& operator --()
+    template <class TType>
+    static inline bool EstimateMin(const IRangeImpl<TType>* first,
+        const IRangeImpl<TType>* second, std::size_t& size)
+    {
+        std::size_t lhs;
+        std::size_t rhs;
+        const bool hasFirst = first->EstimateSize(lhs);
+        const bool hasSecond = second->EstimateSize(rhs);
+        if (hasFirst && hasSecond)
         {
-            return *this;
+            size = std::min(lhs, rhs);
         }
-    };
-
-    template <class TType>
-    class TConcatenatedRangesImpl: public IRangeImpl<TType>
+        else if (hasFirst)
+        {
+            size = lhs;
+        }
+        else if (hasSecond)
+        {
+            size = rhs;
+        }
+        return hasFirst || hasSecond;
+    }
+
+    // Operand of commutative and associative operation TNode contributes to
+    // fingerprint with its operands if it is the same operation, so the
+    // fingerprint doesn't depend on operands order and grouping
+    template <class TNode, class TType>
+    static inline TFingerprint OperandFingerprint(
+        const IRangeImpl<TType>* range)
     {
-        IRangeImpl<TType>* const First_;
-        IRangeImpl<TType>* const Second_;
-        IRangeImpl<TType>* ActiveRange_;
-
-        template <class TAssert>
-        TConcatenatedRangesImpl(TRange<TType, TAssert>& first,
-            TRange<TType, TAssert>& second);
+        const TNode* node = dynamic_cast<const TNode*>(range);
+        if (node && node->GetOperands())
+        {
+            return node->GetOperands();
+        }
+        else
+        {
+            const TFingerprint fingerprint = range->Fingerprint();
+            return fingerprint ? MixFingerprint(fingerprint) : 0;
+        }
+    }
 
-    public:
-        template <class TAssert>
-        TConcatenatedRangesImpl(IRangeImpl<TType>* first,
-            TRange<TType, TAssert>& second);
+    template <class TNode, class TType>
+    static inline TFingerprint OperandsFingerprint(
+        const IRangeImpl<TType>* first, const IRangeImpl<TType>* second)
+    {
+        const TFingerprint lhs = OperandFingerprint<TNode>(first);
+        const TFingerprint rhs = OperandFingerprint<TNode>(second);
+        return lhs && rhs ? lhs + rhs : 0;
+    }
+
+    // Operands of a set operation node as they were when the node was built.
+    // Unlike the node fingerprint, it isn't reset when the node is advanced,
+    // so expressions still can be compared after their constructors skipped
+    // to the first element
+    struct TOperandsIdentity
+    {
+        TFingerprint Fingerprints_[2];
+        // Operand is a node of the same commutative and associative
+        // operation, which operands are compared instead
+        bool Nested_[2];
 
-        inline ~TConcatenatedRangesImpl()
+        template <class TType>
+        TOperandsIdentity(const IRangeImpl<TType>* first,
+            const IRangeImpl<TType>* second)
         {
-            delete First_;
-            delete Second_;
+            Fingerprints_[0] = first->Fingerprint();
+            Fingerprints_[1] = second->Fingerprint();
+            Nested_[0] = false;
+            Nested_[1] = false;
         }
+    };
 
-        inline bool IsEmpty() const
+    template <class TNode, class TType>
+    static TOperandsIdentity CaptureOperands(const IRangeImpl<TType>* first,
+        const IRangeImpl<TType>* second)
+    {
+        TOperandsIdentity result(first, second);
+        const TNode* node = dynamic_cast<const TNode*>(first);
+        result.Nested_[0] = node && node->GetOperands();
+        node = dynamic_cast<const TNode*>(second);
+        result.Nested_[1] = node && node->GetOperands();
+        return result;
+    }
+
+    // Collects operands fingerprints of commutative and associative operation
+    // TNode, the same way OperandFingerprint() descends into them
+    template <class TNode>
+    static void CollectOperands(const TNode& node,
+        std::vector<TFingerprint>& operands)
+    {
+        const TOperandsIdentity& identity = node.GetIdentity();
+        if (identity.Nested_[0])
         {
-            return ActiveRange_->IsEmpty();
+            CollectOperands(static_cast<const TNode&>(*node.GetFirst()),
+                operands);
         }
-
-        inline void Pop()
+        else
         {
-            ActiveRange_->Pop();
-            if (ActiveRange_->IsEmpty())
-            {
-                ActiveRange_ = Second_;
-            }
+            operands.push_back(identity.Fingerprints_[0]);
+        }
+        if (identity.Nested_[1])
+        {
+            CollectOperands(static_cast<const TNode&>(*node.GetSecond()),
+                operands);
+        }
+        else
+        {
+            operands.push_back(identity.Fingerprints_[1]);
         }
+    }
 
-        inline TType Front() const
+    // Checks that nodes of commutative and associative operation TNode were
+    // built from the same operands regardless of their order and grouping
+    template <class TNode, class TType>
+    static bool SameOperands(const TNode& lhs, const IRangeImpl<TType>& rhs)
+    {
+        const TNode* node = dynamic_cast<const TNode*>(&rhs);
+        if (!node || !lhs.GetOperands() || !node->GetOperands())
         {
-            return ActiveRange_->Front();
+            return false;
         }
+        std::vector<TFingerprint> first;
+        std::vector<TFingerprint> second;
+        CollectOperands(lhs, first);
+        CollectOperands(*node, second);
+        std::sort(first.begin(), first.end());
+        std::sort(second.begin(), second.end());
+        return first == second;
+    }
 
-        IRangeImpl<TType>* Clone() const;
-    };
+    template <class TType>
+    class TSequenceRangeImpl;
 
-    template <class TType, class TCompare>
-    class TUnitedRangesImpl: public IRangeImpl<TType>
+    // Owns a range and caches its head, so that each element is fetched from
+    // the underlying range only once, no matter how many times it is compared
+    template <class TType>
+    class TRangeHead
     {
-        IRangeImpl<TType>* const First_;
-        IRangeImpl<TType>* const Second_;
-        IRangeImpl<TType>* ActiveRange_;
-        TCompare Compare_;
-        bool PopBoth_;
-
-        template <class TAssert>
-        TUnitedRangesImpl(TRange<TType, TAssert>& first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        IRangeImpl<TType>* const Range_;
+        TSequenceRangeImpl<TType>* const Sequence_;
+        // Constructed only while range is not empty
+        TValueStorage<TType> Front_;
+        bool Empty_;
 
-    public:
-        template <class TAssert>
-        TUnitedRangesImpl(IRangeImpl<TType>* first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        TRangeHead(const TRangeHead&);
+        TRangeHead& operator =(const TRangeHead&);
 
-        inline ~TUnitedRangesImpl()
+        inline void SetFront(const TType& value)
         {
-            delete First_;
-            delete Second_;
+            if (Empty_)
+            {
+                new (Front_.Data_) TType(value);
+                Empty_ = false;
+            }
+            else
+            {
+                Front_.Get() = value;
+            }
         }
 
-        inline bool IsEmpty() const
+        inline void Clear()
         {
-            return First_->IsEmpty() && Second_->IsEmpty();
+            if (!Empty_)
+            {
+                Front_.Get().~TType();
+                Empty_ = true;
+            }
         }
 
-        inline void Pop()
+        inline void Fetch()
         {
-            if (PopBoth_)
+            if (Range_->IsEmpty())
             {
-                First_->Pop();
-                Second_->Pop();
-                PopBoth_ = false;
+                Clear();
             }
             else
             {
-                ActiveRange_->Pop();
+                SetFront(Range_->Front());
             }
+        }
+
+    public:
+        inline explicit TRangeHead(IRangeImpl<TType>* range)
+            : Range_(range)
+            , Sequence_(dynamic_cast<TSequenceRangeImpl<TType>*>(range))
+            , Empty_(true)
+        {
+            Fetch();
+        }
+
+        inline ~TRangeHead()
+        {
+            Clear();
+            delete Range_;
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Empty_;
+        }
+
+        inline void Pop()
+        {
+            Range_->Pop();
+            Fetch();
+        }
+
+        inline const TType& Front() const
+        {
+            return Front_.Get();
+        }
+
+        // Pops elements which are less than value. Sequences are searched
+        // instead of being popped one by one.
+        template <class TCompare>
+        void SkipTo(const TType& value, TCompare& compare)
+        {
+            if (Sequence_)
+            {
+                Sequence_->SkipTo(value, compare);
+                Fetch();
+            }
+            else
+            {
+                while (!Empty_ && TStrictWeakOrder<TCompare>::Less(compare,
+                    Front(), value))
+                {
+                    Pop();
+                }
+            }
+        }
+
+        inline bool Rewind(const TRangeHead& source)
+        {
+            if (!RewindRange(Range_, *source.Range_))
+            {
+                return false;
+            }
+            if (source.Empty_)
+            {
+                Clear();
+            }
+            else
+            {
+                SetFront(source.Front());
+            }
+            return true;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return Range_->Clone();
+        }
+
+        inline IRangeImpl<TType>* Clone(TArena* arena) const
+        {
+            return arena ? Range_->CloneTo(*arena) : Range_->Clone();
+        }
+
+        inline const IRangeImpl<TType>* Get() const
+        {
+            return Range_;
+        }
+    };
+
+    // Owned contiguous buffer of sequence storage
+    template <class TType>
+    class TSequenceBuffer
+    {
+        std::vector<TType> Data_;
+
+    public:
+        // Takes contents of data away without copying
+        inline void Take(std::vector<TType>& data)
+        {
+            Data_.swap(data);
+        }
+
+        inline const TType* GetData() const
+        {
+            return Data_.empty() ? 0 : &Data_[0];
+        }
+    };
+
+    // std::vector<bool> packs values into bits, so they are copied to array
+    template <>
+    class TSequenceBuffer<bool>
+    {
+        bool* Data_;
+
+        TSequenceBuffer(const TSequenceBuffer&);
+        TSequenceBuffer& operator =(const TSequenceBuffer&);
+
+    public:
+        inline TSequenceBuffer()
+            : Data_(0)
+        {
+        }
+
+        inline ~TSequenceBuffer()
+        {
+            delete[] Data_;
+        }
+
+        inline void Take(std::vector<bool>& data)
+        {
+            Data_ = new bool[data.size()];
+            std::copy(data.begin(), data.end(), Data_);
+            std::vector<bool>().swap(data);
+        }
+
+        inline const bool* GetData() const
+        {
+            return Data_;
+        }
+    };
+
+    template <class TType>
+    class TSequenceRangeImpl: public IRangeImpl<TType>
+    {
+        typedef std::vector<TType> TData_;
+
+        // Storages of at least two blocks get zone map on the first seek:
+        // the last element of each full block, so that seeking in sorted data
+        // skips whole blocks while touching one value per block
+        static const std::size_t BlockSize_ = 128;
+
+        // Span of values which either lives in owned vector or refers to
+        // external buffer
+        class TSharedStorage_
+        {
+            TSequenceBuffer<TType> Data_;
+            const TType* First_;
+            const TType* Last_;
+            TData_ Fences_;
+            TSketch* Sketch_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+            // Copies of the range may seek the same storage concurrently
+            std::once_flag Zoned_;
+#else
+            unsigned Counter_;
+            bool Zoned_;
+#endif
+
+            void BuildZoneMap()
+            {
+                const std::size_t size = Last_ - First_;
+                if (size >= 2 * BlockSize_)
+                {
+                    Fences_.reserve(size / BlockSize_);
+                    for (std::size_t i = BlockSize_ - 1; i < size;
+                        i += BlockSize_)
+                    {
+                        Fences_.push_back(First_[i]);
+                    }
+                }
+            }
+
+        public:
+            // Takes contents of data away
+            inline explicit TSharedStorage_(TData_& data)
+                : First_(0)
+                , Last_(0)
+                , Sketch_(0)
+                , Counter_(1)
+#if __cplusplus < 201103L
+                , Zoned_(false)
+#endif
+            {
+                const std::size_t size = data.size();
+                Data_.Take(data);
+                First_ = Data_.GetData();
+                Last_ = First_ + size;
+            }
+
+            inline TSharedStorage_(const TType* first, const TType* last)
+                : First_(first)
+                , Last_(last)
+                , Sketch_(0)
+                , Counter_(1)
+#if __cplusplus < 201103L
+                , Zoned_(false)
+#endif
+            {
+            }
+
+            inline ~TSharedStorage_()
+            {
+                delete Sketch_;
+            }
+
+            template <class THashFunc>
+            void AttachSketch(THashFunc hash)
+            {
+                if (!Sketch_)
+                {
+                    TSketch* sketch = new TSketch;
+                    for (const TType* iter = First_; iter != Last_; ++iter)
+                    {
+                        sketch->Add(hash(*iter));
+                    }
+                    Sketch_ = sketch;
+                }
+            }
+
+            inline const TSketch* GetSketch() const
+            {
+                return Sketch_;
+            }
+
+            inline void IncreaseCounter()
+            {
+                ++Counter_;
+            }
+
+            inline unsigned DecreaseCounter()
+            {
+                return --Counter_;
+            }
+
+            inline const TType* GetFirst() const
+            {
+                return First_;
+            }
+
+            inline const TType* GetLast() const
+            {
+                return Last_;
+            }
+
+            // Builds zone map on the first call, so that storages which are
+            // never searched, like views and unsorted data, don't pay for it
+            inline const TData_& GetFences()
+            {
+#if __cplusplus >= 201103L
+                std::call_once(Zoned_, &TSharedStorage_::BuildZoneMap, this);
+#else
+                if (!Zoned_)
+                {
+                    BuildZoneMap();
+                    Zoned_ = true;
+                }
+#endif
+                return Fences_;
+            }
+        };
+
+        TSharedStorage_* Storage_;
+        const TType* Begin_;
+        const TType* const End_;
+
+        // Finds the number of leading elements less than value in sorted
+        // data with exponential search
+        template <class TIterator, class TCompare>
+        static typename TData_::size_type CountLess(TIterator first,
+            typename TData_::size_type size, const TType& value,
+            TCompare& compare)
+        {
+            typedef typename TData_::size_type TSizeType_;
+            if (!size
+                || !TStrictWeakOrder<TCompare>::Less(compare, *first, value))
+            {
+                return 0;
+            }
+            // first[lower] is always less than value, while first[upper] is
+            // not (if upper is not past the end)
+            TSizeType_ lower = 0;
+            TSizeType_ step = 1;
+            while (step < size && TStrictWeakOrder<TCompare>::Less(compare,
+                first[step], value))
+            {
+                lower = step;
+                step *= 2;
+            }
+            TSizeType_ upper = std::min(step, size);
+            while (upper - lower > 1)
+            {
+                const TSizeType_ middle = lower + (upper - lower) / 2;
+                if (TStrictWeakOrder<TCompare>::Less(compare, first[middle],
+                    value))
+                {
+                    lower = middle;
+                }
+                else
+                {
+                    upper = middle;
+                }
+            }
+            return upper;
+        }
+
+        static TData_ ConvertToSequence(IRangeImpl<TType>* range)
+        {
+            TData_ result;
+            while (!range->IsEmpty())
+            {
+                result.push_back(range->Front());
+                range->Pop();
+            }
+            return result;
+        }
+
+        static inline TSharedStorage_* Store(TData_ data)
+        {
+            return new TSharedStorage_(data);
+        }
+
+        inline TSequenceRangeImpl(const TSequenceRangeImpl* range)
+            : Storage_(range->Storage_)
+            , Begin_(range->Begin_)
+            , End_(range->End_)
+        {
+            Storage_->IncreaseCounter();
+        }
+
+        inline explicit TSequenceRangeImpl(TSharedStorage_* storage)
+            : Storage_(storage)
+            , Begin_(Storage_->GetFirst())
+            , End_(Storage_->GetLast())
+        {
+        }
+
+        inline TSequenceRangeImpl(TSharedStorage_* storage,
+            const TType* begin, const TType* end)
+            : Storage_(storage)
+            , Begin_(begin)
+            , End_(end)
+        {
+        }
+
+
+        friend class TArenaAllocated<TSequenceRangeImpl>;
+
+    public:
+        typedef typename TData_::size_type TSizeType_;
+
+        inline TSequenceRangeImpl(IRangeImpl<TType>* range)
+            : Storage_(Store(ConvertToSequence(range)))
+            , Begin_(Storage_->GetFirst())
+            , End_(Storage_->GetLast())
+        {
+            delete range;
+        }
+
+        inline TSequenceRangeImpl(TSizeType_ size, const TType& value)
+            : Storage_(Store(TData_(size, value)))
+            , Begin_(Storage_->GetFirst())
+            , End_(Storage_->GetLast())
+        {
+        }
+
+        template <class TInputIterator>
+        inline TSequenceRangeImpl(TInputIterator first, TInputIterator last)
+            : Storage_(Store(TData_(first, last)))
+            , Begin_(Storage_->GetFirst())
+            , End_(Storage_->GetLast())
+        {
+        }
+
+        // Takes contents of data without copying them
+        static inline TSequenceRangeImpl* Adopt(TData_& data)
+        {
+            return new TSequenceRangeImpl(new TSharedStorage_(data));
+        }
+
+        // Refers to [first, last) without copying, the buffer must outlive
+        // the range and all its copies
+        static inline TSequenceRangeImpl* View(const TType* first,
+            const TType* last)
+        {
+            return new TSequenceRangeImpl(new TSharedStorage_(first, last));
+        }
+
+        inline ~TSequenceRangeImpl()
+        {
+            if (Storage_ && !Storage_->DecreaseCounter())
+            {
+                delete Storage_;
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Begin_ == End_;
+        }
+
+        inline void Pop()
+        {
+            ++Begin_;
+        }
+
+        inline TType Front() const
+        {
+            return *Begin_;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TSequenceRangeImpl& from =
+                static_cast<const TSequenceRangeImpl&>(source);
+            if (Storage_ != from.Storage_ || End_ != from.End_)
+            {
+                return false;
+            }
+            Begin_ = from.Begin_;
+            return true;
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            if (size > static_cast<std::size_t>(End_ - Begin_))
+            {
+                size = End_ - Begin_;
+            }
+            std::copy(Begin_, Begin_ + size, buffer);
+            Begin_ += size;
+            return size;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TSequenceRangeImpl(this);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TArena& arena) const
+        {
+            return new (arena) TArenaAllocated<TSequenceRangeImpl>(this);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TRangeBuffer& buffer) const
+        {
+            if (sizeof(TSequenceRangeImpl) <= sizeof(buffer))
+            {
+                return new (&buffer) TSequenceRangeImpl(this);
+            }
+            return Clone();
+        }
+
+        // Passes storage reference to the new cursor without touching the
+        // counter
+        IRangeImpl<TType>* MoveTo(TRangeBuffer* buffer)
+        {
+            TSequenceRangeImpl* result =
+                buffer && sizeof(TSequenceRangeImpl) <= sizeof(*buffer) ?
+                    new (buffer) TSequenceRangeImpl(Storage_, Begin_, End_)
+                    : new TSequenceRangeImpl(Storage_, Begin_, End_);
+            Storage_ = 0;
+            return result;
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            size = End_ - Begin_;
+            return true;
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            if (Begin_ == End_)
+            {
+                return false;
+            }
+            first = *Begin_;
+            last = *(End_ - 1);
+            return true;
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            size = End_ - Begin_;
+            return true;
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return GetSize(size);
+        }
+
+        // Sketch is computed once for the whole storage and is shared by
+        // copies, so it should be attached before copies are passed to other
+        // threads
+        template <class THashFunc>
+        inline void AttachSketch(THashFunc hash)
+        {
+            Storage_->AttachSketch(hash);
+        }
+
+        // Sketch describes the whole storage, so it is unavailable after the
+        // first Pop()
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            const TSketch* attached = Storage_->GetSketch();
+            if (attached && Begin_ == Storage_->GetFirst()
+                && End_ == Storage_->GetLast())
+            {
+                sketch.Merge(*attached);
+                return true;
+            }
+            return false;
+        }
+
+        inline const TType* GetBegin() const
+        {
+            return Begin_;
+        }
+
+        inline const TType* GetEnd() const
+        {
+            return End_;
+        }
+
+        inline void Skip(TSizeType_ count)
+        {
+            Begin_ += count;
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            program.AddLeaf(this);
+            return true;
+        }
+
+        // Skips elements which are less than value. Blocks which end before
+        // value are skipped by zone map, then exponential search is used, so
+        // skipping over n elements takes O(log n) comparisons.
+        template <class TCompare>
+        void SkipTo(const TType& value, TCompare& compare)
+        {
+            if (Begin_ == End_
+                || !TStrictWeakOrder<TCompare>::Less(compare, *Begin_, value))
+            {
+                return;
+            }
+            const TType* data = Storage_->GetFirst();
+            const TData_& fences = Storage_->GetFences();
+            const TSizeType_ block = (Begin_ - data) / BlockSize_;
+            if (block < fences.size() && TStrictWeakOrder<TCompare>::Less(
+                compare, fences[block], value))
+            {
+                const TSizeType_ next = block + 1;
+                const TSizeType_ skipped = next + CountLess(
+                    fences.begin() + next, fences.size() - next, value,
+                    compare);
+                Begin_ = data + std::min<TSizeType_>(skipped * BlockSize_,
+                    End_ - data);
+            }
+            Begin_ += CountLess(Begin_, End_ - Begin_, value, compare);
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            const TType* data = Storage_->GetFirst();
+            return CombineFingerprints(CombineFingerprints(
+                AddressFingerprint(Storage_), (Begin_ - data) + 1),
+                    (End_ - data) + 1);
+        }
+
+        inline bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            const TSequenceRangeImpl* sequence =
+                dynamic_cast<const TSequenceRangeImpl*>(&range);
+            return sequence && Storage_ == sequence->Storage_
+                && Begin_ == sequence->Begin_ && End_ == sequence->End_;
+        }
+    };
+
+    template <class TType>
+    const std::size_t TSequenceRangeImpl<TType>::BlockSize_;
+
+    // Counts result of set operation over sorted sequences the same way as
+    // merging nodes do, but without fetching and copying elements. Operands
+    // other than sequences, including nested operations, aren't counted.
+    template <class TType, class TCompare>
+    static bool CountSequences(const IRangeImpl<TType>* lhs,
+        const IRangeImpl<TType>* rhs, TCompare compare, unsigned table,
+        std::size_t& size)
+    {
+        const TSequenceRangeImpl<TType>* first =
+            dynamic_cast<const TSequenceRangeImpl<TType>*>(lhs);
+        const TSequenceRangeImpl<TType>* second =
+            dynamic_cast<const TSequenceRangeImpl<TType>*>(rhs);
+        if (!first || !second)
+        {
+            return false;
+        }
+        const TType* lhsIter = first->GetBegin();
+        const TType* rhsIter = second->GetBegin();
+        size = 0;
+        while (lhsIter != first->GetEnd() && rhsIter != second->GetEnd())
+        {
+            const int order =
+                TThreeWay<TCompare>::Compare(compare, *lhsIter, *rhsIter);
+            if (order < 0)
+            {
+                size += (table >> 1) & 1;
+                ++lhsIter;
+            }
+            else if (order > 0)
+            {
+                size += (table >> 2) & 1;
+                ++rhsIter;
+            }
+            else
+            {
+                size += (table >> 3) & 1;
+                ++lhsIter;
+                ++rhsIter;
+            }
+        }
+        if ((table >> 1) & 1)
+        {
+            size += first->GetEnd() - lhsIter;
+        }
+        if ((table >> 2) & 1)
+        {
+            size += second->GetEnd() - rhsIter;
+        }
+        return true;
+    }
+
+    // Element-wise step of compiled program, which processes a block of
+    // values at once
+    template <class TType>
+    class IBlockFilter
+    {
+    public:
+        virtual inline ~IBlockFilter()
+        {
+        }
+
+        virtual void Apply(const TType* first, const TType* last,
+            std::vector<TType>& output) = 0;
+        virtual IBlockFilter* Clone() const = 0;
+    };
+
+    template <class TType, class TPredicate>
+    class TRemoveFilter: public IBlockFilter<TType>
+    {
+        TPredicate Predicate_;
+
+    public:
+        inline explicit TRemoveFilter(TPredicate predicate)
+            : Predicate_(predicate)
+        {
+        }
+
+        void Apply(const TType* first, const TType* last,
+            std::vector<TType>& output)
+        {
+            for (; first != last; ++first)
+            {
+                if (!Predicate_(*first))
+                {
+                    output.push_back(*first);
+                }
+            }
+        }
+
+        inline IBlockFilter<TType>* Clone() const
+        {
+            return new TRemoveFilter(Predicate_);
+        }
+    };
+
+    // Remembers the last value emitted, so that runs of equal values are
+    // collapsed across block boundaries
+    template <class TType, class TCompare>
+    class TUniqueFilter: public IBlockFilter<TType>
+    {
+        TCompare Compare_;
+        TType Last_;
+        bool Started_;
+
+    public:
+        inline explicit TUniqueFilter(TCompare compare)
+            : Compare_(compare)
+            , Last_()
+            , Started_(false)
+        {
+        }
+
+        void Apply(const TType* first, const TType* last,
+            std::vector<TType>& output)
+        {
+            for (; first != last; ++first)
+            {
+                if (!Started_ || !Compare_(Last_, *first))
+                {
+                    Last_ = *first;
+                    Started_ = true;
+                    output.push_back(*first);
+                }
+            }
+        }
+
+        inline IBlockFilter<TType>* Clone() const
+        {
+            return new TUniqueFilter(*this);
+        }
+    };
+
+    // Set algebra over sorted sequences flattened into instructions, the
+    // result of each instruction is stored in register with the same index.
+    // Program is run block by block: each step takes from every sequence
+    // elements up to the common bound, so that all equal values fall into
+    // the same block, and evaluates instructions in order with merge loops.
+    // Set operations must be ordered by std::less, as the nodes require.
+    template <class TType>
+    class TProgram
+    {
+    public:
+        // Set operations are encoded with their TSetOperation tables
+        enum
+        {
+            Load_ = 0,
+            Filter_ = 1
+        };
+
+    private:
+        typedef std::pair<const TType*, const TType*> TRegister_;
+
+        struct TInstruction_
+        {
+            unsigned Opcode_;
+            // Leaf index for Load_, operand registers otherwise
+            std::size_t First_;
+            std::size_t Second_;
+            IBlockFilter<TType>* Filter_;
+        };
+
+        static const std::size_t BlockSize_ = 512;
+
+        std::vector<TInstruction_> Instructions_;
+        std::vector<TSequenceRangeImpl<TType>*> Leaves_;
+        std::vector<TRegister_> Registers_;
+        std::vector<std::vector<TType> > Buffers_;
+
+        TProgram& operator =(const TProgram&);
+
+        static inline TRegister_ Refer(const std::vector<TType>& buffer)
+        {
+            return buffer.empty() ? TRegister_(0, 0)
+                : TRegister_(&buffer[0], &buffer[0] + buffer.size());
+        }
+
+        inline void Add(unsigned opcode, std::size_t first,
+            std::size_t second, IBlockFilter<TType>* filter)
+        {
+            TInstruction_ instruction = {opcode, first, second, filter};
+            Instructions_.push_back(instruction);
+            Registers_.push_back(TRegister_(0, 0));
+            Buffers_.push_back(std::vector<TType>());
+        }
+
+        // Ties take rhs element if it is kept, as union node does
+        static void Merge(TRegister_ lhs, TRegister_ rhs, unsigned table,
+            std::vector<TType>& output)
+        {
+            std::less<TType> less;
+            while (lhs.first != lhs.second && rhs.first != rhs.second)
+            {
+                const int order = TThreeWay<std::less<TType> >::Compare(less,
+                    *lhs.first, *rhs.first);
+                if (order < 0)
+                {
+                    if (table & 2)
+                    {
+                        output.push_back(*lhs.first);
+                    }
+                    ++lhs.first;
+                }
+                else if (order > 0)
+                {
+                    if (table & 4)
+                    {
+                        output.push_back(*rhs.first);
+                    }
+                    ++rhs.first;
+                }
+                else
+                {
+                    if (table & 8)
+                    {
+                        output.push_back(table & 4 ? *rhs.first : *lhs.first);
+                    }
+                    ++lhs.first;
+                    ++rhs.first;
+                }
+            }
+            if (table & 2)
+            {
+                output.insert(output.end(), lhs.first, lhs.second);
+            }
+            if (table & 4)
+            {
+                output.insert(output.end(), rhs.first, rhs.second);
+            }
+        }
+
+        // Picks the number of elements each leaf contributes to the step.
+        // Bound is the smallest of values at BlockSize_ - 1 offset, so the
+        // leaf which has it advances by at least BlockSize_ elements.
+        void Split(std::vector<std::size_t>& sizes) const
+        {
+            const TType* bound = 0;
+            std::less<TType> less;
+            for (std::size_t i = 0; i < Leaves_.size(); ++i)
+            {
+                const TType* begin = Leaves_[i]->GetBegin();
+                if (std::size_t(Leaves_[i]->GetEnd() - begin) > BlockSize_
+                    && (!bound || less(begin[BlockSize_ - 1], *bound)))
+                {
+                    bound = begin + BlockSize_ - 1;
+                }
+            }
+            for (std::size_t i = 0; i < Leaves_.size(); ++i)
+            {
+                const TType* begin = Leaves_[i]->GetBegin();
+                const TType* end = Leaves_[i]->GetEnd();
+                if (Leaves_.size() == 1)
+                {
+                    end = begin + std::min<std::size_t>(end - begin,
+                        BlockSize_);
+                }
+                else if (bound)
+                {
+                    end = std::upper_bound(begin, end, *bound, less);
+                }
+                sizes[i] = end - begin;
+            }
+        }
+
+    public:
+        inline TProgram()
+        {
+        }
+
+        TProgram(const TProgram& program)
+            : Instructions_(program.Instructions_)
+            , Registers_(program.Registers_)
+            , Buffers_(program.Buffers_)
+        {
+            Leaves_.reserve(program.Leaves_.size());
+            for (std::size_t i = 0; i < program.Leaves_.size(); ++i)
+            {
+                Leaves_.push_back(static_cast<TSequenceRangeImpl<TType>*>(
+                    program.Leaves_[i]->Clone()));
+            }
+            for (std::size_t i = 0; i < Instructions_.size(); ++i)
+            {
+                TInstruction_& instruction = Instructions_[i];
+                if (instruction.Filter_)
+                {
+                    instruction.Filter_ = instruction.Filter_->Clone();
+                }
+                if (instruction.Opcode_ != Load_)
+                {
+                    Registers_[i] = Refer(Buffers_[i]);
+                }
+            }
+        }
+
+        ~TProgram()
+        {
+            for (std::size_t i = 0; i < Leaves_.size(); ++i)
+            {
+                delete Leaves_[i];
+            }
+            for (std::size_t i = 0; i < Instructions_.size(); ++i)
+            {
+                delete Instructions_[i].Filter_;
+            }
+        }
+
+        inline std::size_t GetSize() const
+        {
+            return Instructions_.size();
+        }
+
+        inline void AddLeaf(const TSequenceRangeImpl<TType>* leaf)
+        {
+            Leaves_.push_back(
+                static_cast<TSequenceRangeImpl<TType>*>(leaf->Clone()));
+            Add(Load_, Leaves_.size() - 1, 0, 0);
+        }
+
+        // Set operations are compiled only if ordered by std::less
+        template <class TCompare>
+        inline bool AddOperation(const IRangeImpl<TType>*,
+            const IRangeImpl<TType>*, TCompare, unsigned)
+        {
+            return false;
+        }
+
+        bool AddOperation(const IRangeImpl<TType>* first,
+            const IRangeImpl<TType>* second, std::less<TType>, unsigned table)
+        {
+            if (!first->Compile(*this))
+            {
+                return false;
+            }
+            const std::size_t lhs = Instructions_.size() - 1;
+            if (!second->Compile(*this))
+            {
+                return false;
+            }
+            Add(table, lhs, Instructions_.size() - 1, 0);
+            return true;
+        }
+
+        bool AddFilter(const IRangeImpl<TType>* range,
+            const IBlockFilter<TType>& filter)
+        {
+            if (!range->Compile(*this))
+            {
+                return false;
+            }
+            AddFilter(filter);
+            return true;
+        }
+
+        // Applies filter to the result of the last instruction
+        inline void AddFilter(const IBlockFilter<TType>& filter)
+        {
+            const std::size_t operand = Instructions_.size() - 1;
+            IBlockFilter<TType>* clone = filter.Clone();
+            Add(Filter_, operand, 0, clone);
+        }
+
+        // Evaluates the next block of output into [first, last), which stays
+        // valid until the next step. Returns false if inputs are exhausted.
+        bool Step(const TType*& first, const TType*& last)
+        {
+            bool exhausted = true;
+            for (std::size_t i = 0; i < Leaves_.size(); ++i)
+            {
+                exhausted = exhausted && Leaves_[i]->IsEmpty();
+            }
+            if (exhausted)
+            {
+                return false;
+            }
+            std::vector<std::size_t> sizes(Leaves_.size());
+            Split(sizes);
+            for (std::size_t i = 0; i < Instructions_.size(); ++i)
+            {
+                const TInstruction_& instruction = Instructions_[i];
+                std::vector<TType>& buffer = Buffers_[i];
+                buffer.clear();
+                switch (instruction.Opcode_)
+                {
+                    case Load_:
+                    {
+                        const TType* begin =
+                            Leaves_[instruction.First_]->GetBegin();
+                        Registers_[i] = TRegister_(begin,
+                            begin + sizes[instruction.First_]);
+                        continue;
+                    }
+                    case Filter_:
+                        instruction.Filter_->Apply(
+                            Registers_[instruction.First_].first,
+                            Registers_[instruction.First_].second, buffer);
+                        break;
+                    default:
+                        Merge(Registers_[instruction.First_],
+                            Registers_[instruction.Second_],
+                            instruction.Opcode_, buffer);
+                        break;
+                }
+                Registers_[i] = Refer(buffer);
+            }
+            for (std::size_t i = 0; i < Leaves_.size(); ++i)
+            {
+                Leaves_[i]->Skip(sizes[i]);
+            }
+            GetOutput(first, last);
+            return true;
+        }
+
+        inline void GetOutput(const TType*& first, const TType*& last) const
+        {
+            first = Registers_.back().first;
+            last = Registers_.back().second;
+        }
+    };
+
+    template <class TType>
+    const std::size_t TProgram<TType>::BlockSize_;
+
+    // Runs compiled program and emits its output blocks
+    template <class TType>
+    class TCompiledRangeImpl: public IRangeImpl<TType>
+    {
+        TProgram<TType> Program_;
+        const TType* Begin_;
+        const TType* End_;
+
+        inline TCompiledRangeImpl()
+            : Begin_(0)
+            , End_(0)
+        {
+        }
+
+        // Registers of program copy refer to its own buffers
+        inline explicit TCompiledRangeImpl(const TCompiledRangeImpl* range)
+            : Program_(range->Program_)
+        {
+            const TType* first;
+            const TType* last;
+            range->Program_.GetOutput(first, last);
+            Program_.GetOutput(Begin_, End_);
+            Begin_ += range->Begin_ - first;
+        }
+
+        inline void Next()
+        {
+            while (Begin_ == End_ && Program_.Step(Begin_, End_))
+            {
+            }
+        }
+
+    public:
+        // Returns null if range can't be compiled or is a leaf already
+        static TCompiledRangeImpl* Compile(const IRangeImpl<TType>* range)
+        {
+            TCompiledRangeImpl* result = new TCompiledRangeImpl;
+            if (!range->Compile(result->Program_)
+                || result->Program_.GetSize() < 2)
+            {
+                delete result;
+                return 0;
+            }
+            result->Next();
+            return result;
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Begin_ == End_;
+        }
+
+        inline void Pop()
+        {
+            ++Begin_;
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return *Begin_;
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = 0;
+            while (count < size && Begin_ != End_)
+            {
+                std::size_t chunk = End_ - Begin_;
+                if (chunk > size - count)
+                {
+                    chunk = size - count;
+                }
+                std::copy(Begin_, Begin_ + chunk, buffer + count);
+                Begin_ += chunk;
+                count += chunk;
+                Next();
+            }
+            return count;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TCompiledRangeImpl(this);
+        }
+    };
+
+    // Copies of adaptive range share recomputation statistics of the
+    // subtree. Once copies have popped Threshold_ times more elements than
+    // the subtree holds, the subtree is materialized into shared sequence
+    // and all further copies become cheap sequence cursors.
+    template <class TType>
+    class TAdaptiveRangeImpl: public IRangeImpl<TType>
+    {
+        typedef typename TSequenceRangeImpl<TType>::TSizeType_ TSizeType_;
+
+        class TSharedState_
+        {
+            IRangeImpl<TType>* Origin_;
+            TSequenceRangeImpl<TType>* Sequence_;
+            TSizeType_ Work_;
+            TSizeType_ Length_;
+            bool LengthKnown_;
+            const unsigned Threshold_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+#else
+            unsigned Counter_;
+#endif
+
+        public:
+            inline TSharedState_(IRangeImpl<TType>* origin, unsigned threshold)
+                : Origin_(origin)
+                , Sequence_(0)
+                , Work_(0)
+                , Length_(0)
+                , LengthKnown_(false)
+                , Threshold_(threshold)
+                , Counter_(1)
+            {
+            }
+
+            inline ~TSharedState_()
+            {
+                delete Origin_;
+            }
+
+            inline void IncreaseCounter()
+            {
+                ++Counter_;
+            }
+
+            inline unsigned DecreaseCounter()
+            {
+                return --Counter_;
+            }
+
+            inline void CountPop(TSizeType_ position, bool exhausted)
+            {
+                ++Work_;
+                if (exhausted && !LengthKnown_)
+                {
+                    Length_ = position;
+                    LengthKnown_ = true;
+                }
+            }
+
+            const TSequenceRangeImpl<TType>* GetSequence()
+            {
+                if (!Sequence_ && LengthKnown_
+                    && Work_ / Threshold_ >= Length_)
+                {
+                    Sequence_ = new TSequenceRangeImpl<TType>(Origin_);
+                    Origin_ = Sequence_;
+                }
+                return Sequence_;
+            }
+        };
+
+        TSharedState_* const State_;
+        IRangeImpl<TType>* const Range_;
+        TSizeType_ Position_;
+
+        inline TAdaptiveRangeImpl(TSharedState_* state,
+            IRangeImpl<TType>* range, TSizeType_ position)
+            : State_(state)
+            , Range_(range)
+            , Position_(position)
+        {
+            State_->IncreaseCounter();
+        }
+
+    public:
+        inline TAdaptiveRangeImpl(IRangeImpl<TType>* range, unsigned threshold)
+            : State_(new TSharedState_(range, threshold ? threshold : 1))
+            , Range_(range->Clone())
+            , Position_(0)
+        {
+        }
+
+        inline ~TAdaptiveRangeImpl()
+        {
+            delete Range_;
+            if (!State_->DecreaseCounter())
+            {
+                delete State_;
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Range_->IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Range_->Pop();
+            State_->CountPop(++Position_, Range_->IsEmpty());
+        }
+
+        inline TType Front() const
+        {
+            return Range_->Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_->EstimateSize(size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return Range_->GetSize(size);
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return Range_->GetKnownSize(size);
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return Range_->MergeSketch(sketch);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Range_->GetBounds(first, last);
+        }
+
+        IRangeImpl<TType>* Clone() const
+        {
+            const TSequenceRangeImpl<TType>* sequence = State_->GetSequence();
+            if (sequence)
+            {
+                TSequenceRangeImpl<TType>* result =
+                    static_cast<TSequenceRangeImpl<TType>*>(sequence->Clone());
+                result->Skip(Position_);
+                return result;
+            }
+            else
+            {
+                return new TAdaptiveRangeImpl(State_, Range_->Clone(),
+                    Position_);
+            }
+        }
+    };
+
+    // Value repeated Count_ times
+    template <class TType>
+    class TConstantRangeImpl: public IRangeImpl<TType>
+    {
+        TType Value_;
+        std::size_t Count_;
+
+    public:
+        inline TConstantRangeImpl(std::size_t count, const TType& value)
+            : Value_(value)
+            , Count_(count)
+        {
+        }
+
+        inline bool IsEmpty() const
+        {
+            return !Count_;
+        }
+
+        inline void Pop()
+        {
+            --Count_;
+        }
+
+        inline TType Front() const
+        {
+            return Value_;
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            size = Count_;
+            return true;
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            size = Count_;
+            return true;
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return GetSize(size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            first = last = Value_;
+            return Count_;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TConstantRangeImpl& from =
+                static_cast<const TConstantRangeImpl&>(source);
+            Value_ = from.Value_;
+            Count_ = from.Count_;
+            return true;
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            if (size > Count_)
+            {
+                size = Count_;
+            }
+            std::fill(buffer, buffer + size, Value_);
+            Count_ -= size;
+            return size;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TConstantRangeImpl(Count_, Value_);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TRangeBuffer& buffer) const
+        {
+            if (sizeof(TConstantRangeImpl) <= sizeof(buffer))
+            {
+                return new (&buffer) TConstantRangeImpl(Count_, Value_);
+            }
+            return Clone();
+        }
+    };
+
+    // Sorted integers stored as [begin, end) runs, so contiguous spans of
+    // any length take constant memory. Runs storage is shared between copies.
+    template <class TType>
+    class TIntervalRangeImpl: public IRangeImpl<TType>
+    {
+    public:
+        typedef std::pair<TType, TType> TRun_;
+        typedef std::vector<TRun_> TRuns_;
+
+    private:
+        class TSharedRuns_
+        {
+            const TRuns_ Runs_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+#else
+            unsigned Counter_;
+#endif
+
+        public:
+            inline TSharedRuns_(const TRuns_& runs)
+                : Runs_(runs)
+                , Counter_(1)
+            {
+            }
+
+            inline void IncreaseCounter()
+            {
+                ++Counter_;
+            }
+
+            inline unsigned DecreaseCounter()
+            {
+                return --Counter_;
+            }
+
+            inline const TRuns_& GetRuns() const
+            {
+                return Runs_;
+            }
+        };
+
+        TSharedRuns_* const Runs_;
+        std::size_t Run_;
+        TType Current_;
+
+        inline TIntervalRangeImpl(TSharedRuns_* runs, std::size_t run,
+            TType current)
+            : Runs_(runs)
+            , Run_(run)
+            , Current_(current)
+        {
+            Runs_->IncreaseCounter();
+        }
+
+        // Number of integers in [begin, end), which doesn't fit in TType for
+        // wide runs of signed integers, so it is counted in unsigned type
+        static inline std::size_t Distance(TType begin, TType end)
+        {
+            return static_cast<std::size_t>(end)
+                - static_cast<std::size_t>(begin);
+        }
+
+        // Remaining runs, the first one is trimmed to the current value
+        TRuns_ GetRemainingRuns() const
+        {
+            const TRuns_& runs = Runs_->GetRuns();
+            TRuns_ result(runs.begin() + Run_, runs.end());
+            result.front().first = Current_;
+            return result;
+        }
+
+    public:
+        // Runs must be sorted, non-empty and separated by gaps, use
+        // Normalize() otherwise
+        inline explicit TIntervalRangeImpl(const TRuns_& runs)
+            : Runs_(new TSharedRuns_(runs))
+            , Run_(0)
+            , Current_(runs.front().first)
+        {
+        }
+
+        inline ~TIntervalRangeImpl()
+        {
+            if (!Runs_->DecreaseCounter())
+            {
+                delete Runs_;
+            }
+        }
+
+        static void Normalize(TRuns_& runs)
+        {
+            std::sort(runs.begin(), runs.end());
+            typename TRuns_::iterator last = runs.begin();
+            for (typename TRuns_::iterator iter = runs.begin();
+                iter != runs.end(); ++iter)
+            {
+                if (iter->first < iter->second)
+                {
+                    if (last != runs.begin()
+                        && !((last - 1)->second < iter->first))
+                    {
+                        (last - 1)->second =
+                            std::max((last - 1)->second, iter->second);
+                    }
+                    else
+                    {
+                        *last++ = *iter;
+                    }
+                }
+            }
+            runs.erase(last, runs.end());
+        }
+
+        // Sweeps runs boundaries of both ranges, so that the result is found
+        // in O(runs) regardless of the number of values. Returns 0 if the
+        // result is empty.
+        static TIntervalRangeImpl* Combine(const TIntervalRangeImpl& lhs,
+            const TIntervalRangeImpl& rhs, unsigned table)
+        {
+            const TRuns_ first = lhs.GetRemainingRuns();
+            const TRuns_ second = rhs.GetRemainingRuns();
+            TRuns_ result;
+            std::size_t i = 0;
+            std::size_t j = 0;
+            TType position = std::min(first.front().first,
+                second.front().first);
+            while (i < first.size() || j < second.size())
+            {
+                const bool inFirst =
+                    i < first.size() && !(position < first[i].first);
+                const bool inSecond =
+                    j < second.size() && !(position < second[j].first);
+                TType next = position;
+                bool found = false;
+                if (i < first.size())
+                {
+                    next = inFirst ? first[i].second : first[i].first;
+                    found = true;
+                }
+                if (j < second.size())
+                {
+                    const TType bound =
+                        inSecond ? second[j].second : second[j].first;
+                    next = found ? std::min(next, bound) : bound;
+                }
+                if ((table >> (inFirst + 2 * inSecond)) & 1)
+                {
+                    if (!result.empty() && !(result.back().second < position))
+                    {
+                        result.back().second = next;
+                    }
+                    else
+                    {
+                        result.push_back(TRun_(position, next));
+                    }
+                }
+                position = next;
+                if (i < first.size() && !(position < first[i].second))
+                {
+                    ++i;
+                }
+                if (j < second.size() && !(position < second[j].second))
+                {
+                    ++j;
+                }
+            }
+            return result.empty() ? 0 : new TIntervalRangeImpl(result);
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Run_ == Runs_->GetRuns().size();
+        }
+
+        inline void Pop()
+        {
+            if (!(++Current_ < Runs_->GetRuns()[Run_].second)
+                && ++Run_ < Runs_->GetRuns().size())
+            {
+                Current_ = Runs_->GetRuns()[Run_].first;
+            }
+        }
+
+        inline TType Front() const
+        {
+            return Current_;
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            return CombineFingerprints(AddressFingerprint(Runs_),
+                static_cast<TFingerprint>(Current_)
+                    - static_cast<TFingerprint>(
+                        Runs_->GetRuns().front().first) + 1);
+        }
+
+        inline bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            const TIntervalRangeImpl* interval =
+                dynamic_cast<const TIntervalRangeImpl*>(&range);
+            return interval && Runs_ == interval->Runs_
+                && Run_ == interval->Run_
+                && Current_ == interval->Current_;
+        }
+
+        bool GetSize(std::size_t& size) const
+        {
+            const TRuns_& runs = Runs_->GetRuns();
+            size = 0;
+            if (Run_ < runs.size())
+            {
+                size = Distance(Current_, runs[Run_].second);
+                for (std::size_t i = Run_ + 1; i < runs.size(); ++i)
+                {
+                    size += Distance(runs[i].first, runs[i].second);
+                }
+            }
+            return true;
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return GetSize(size);
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return GetSize(size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            if (IsEmpty())
+            {
+                return false;
+            }
+            first = Current_;
+            last = Runs_->GetRuns().back().second;
+            --last;
+            return true;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TIntervalRangeImpl& from =
+                static_cast<const TIntervalRangeImpl&>(source);
+            if (Runs_ != from.Runs_)
+            {
+                return false;
+            }
+            Run_ = from.Run_;
+            Current_ = from.Current_;
+            return true;
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            const TRuns_& runs = Runs_->GetRuns();
+            std::size_t count = 0;
+            while (count < size && Run_ < runs.size())
+            {
+                const TType last = runs[Run_].second;
+                while (count < size && Current_ < last)
+                {
+                    buffer[count++] = Current_++;
+                }
+                if (!(Current_ < last) && ++Run_ < runs.size())
+                {
+                    Current_ = runs[Run_].first;
+                }
+            }
+            return count;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TIntervalRangeImpl(Runs_, Run_, Current_);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TRangeBuffer& buffer) const
+        {
+            if (sizeof(TIntervalRangeImpl) <= sizeof(buffer))
+            {
+                return new (&buffer) TIntervalRangeImpl(Runs_, Run_, Current_);
+            }
+            return Clone();
+        }
+    };
+
+    // Run arithmetic is available for integer types only. Combine() returns
+    // false if it is not applicable to the ranges, otherwise result is set to
+    // the resulting range or to null if the result is empty.
+    template <class TType, bool IsInteger>
+    struct TIntervalArithmetic
+    {
+        static inline bool Combine(const IRangeImpl<TType>*,
+            const IRangeImpl<TType>*, unsigned, IRangeImpl<TType>*&)
+        {
+            return false;
+        }
+    };
+
+    template <class TType>
+    struct TIntervalArithmetic<TType, true>
+    {
+        static bool Combine(const IRangeImpl<TType>* lhs,
+            const IRangeImpl<TType>* rhs, unsigned table,
+            IRangeImpl<TType>*& result)
+        {
+            const TIntervalRangeImpl<TType>* first =
+                dynamic_cast<const TIntervalRangeImpl<TType>*>(lhs);
+            const TIntervalRangeImpl<TType>* second =
+                dynamic_cast<const TIntervalRangeImpl<TType>*>(rhs);
+            if (first && second)
+            {
+                result = TIntervalRangeImpl<TType>::Combine(*first, *second,
+                    table);
+                return true;
+            }
+            return false;
+        }
+    };
+
+    template <class TType>
+    class TSingleValueRangeImpl: public IRangeImpl<TType>
+    {
+        TType Value_;
+        bool Empty_;
+
+    public:
+        inline explicit TSingleValueRangeImpl(const TType& value,
+            bool empty = false)
+            : Value_(value)
+            , Empty_(empty)
+        {
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Empty_;
+        }
+
+        inline void Pop()
+        {
+            Empty_ = true;
+        }
+
+        inline TType Front() const
+        {
+            return Value_;
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            size = !Empty_;
+            return true;
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            size = !Empty_;
+            return true;
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return GetSize(size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            first = last = Value_;
+            return !Empty_;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TSingleValueRangeImpl& from =
+                static_cast<const TSingleValueRangeImpl&>(source);
+            Value_ = from.Value_;
+            Empty_ = from.Empty_;
+            return true;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TSingleValueRangeImpl(Value_, Empty_);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TRangeBuffer& buffer) const
+        {
+            if (sizeof(TSingleValueRangeImpl) <= sizeof(buffer))
+            {
+                return new (&buffer) TSingleValueRangeImpl(Value_, Empty_);
+            }
+            return Clone();
+        }
+    };
+
+    template <class TType, class TCounter>
+    class TRepeatedRangeImpl: public IRangeImpl<TType>
+    {
+        const IRangeImpl<TType>* const Range_;
+        IRangeImpl<TType>* CurrentRange_;
+        TCounter Counter_;
+
+        // Starts the next repetition
+        void Restart()
+        {
+            if (!RewindRange(CurrentRange_, *Range_))
+            {
+                delete CurrentRange_;
+                CurrentRange_ = Range_->Clone();
+            }
+            --Counter_;
+        }
+
+        template <class TAssert>
+        TRepeatedRangeImpl(TRange<TType, TAssert>& range,
+            TRange<TType, TAssert>& current, TCounter counter);
+
+    public:
+        inline TRepeatedRangeImpl(const IRangeImpl<TType>* range,
+            TCounter counter)
+            : Range_(range)
+            , CurrentRange_(Range_->Clone())
+            , Counter_(counter)
+        {
+            --Counter_;
+        }
+
+        inline ~TRepeatedRangeImpl()
+        {
+            delete CurrentRange_;
+            delete Range_;
+        }
+
+        inline bool IsEmpty() const
+        {
+            return CurrentRange_->IsEmpty() && !Counter_;
+        }
+
+        inline void Pop()
+        {
+            CurrentRange_->Pop();
+            if (CurrentRange_->IsEmpty() && !!Counter_)
+            {
+                Restart();
+            }
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = CurrentRange_->Read(buffer, size);
+            while (CurrentRange_->IsEmpty() && !!Counter_)
+            {
+                Restart();
+                count += CurrentRange_->Read(buffer + count, size - count);
+            }
+            return count;
+        }
+
+        inline TType Front() const
+        {
+            return CurrentRange_->Front();
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TRepeatedRangeImpl& from =
+                static_cast<const TRepeatedRangeImpl&>(source);
+            if (!RewindRange(CurrentRange_, *from.CurrentRange_))
+            {
+                IRangeImpl<TType>* current = from.CurrentRange_->Clone();
+                delete CurrentRange_;
+                CurrentRange_ = current;
+            }
+            Counter_ = from.Counter_;
+            return true;
+        }
+
+        IRangeImpl<TType>* Clone() const;
+    };
+
+    struct TInfiniteCounter
+    {
+        inline bool operator !() const
+        {
+            return false;
+        }
+
+        inline TInfiniteCounter& operator --()
+        {
+            return *this;
+        }
+    };
+
+    // Bounds of range, which nodes find once from bounds of their operands,
+    // so that bounds of deep expressions aren't walked again on each new
+    // node. Bounds stay valid while elements are popped, though the first
+    // one becomes loose, so the current front is reported instead of it.
+    template <class TType>
+    class TBounds
+    {
+        // Constructed only while bounds are known
+        TValueStorage<TType> First_;
+        TValueStorage<TType> Last_;
+        bool Known_;
+
+        inline void Destroy()
+        {
+            if (Known_)
+            {
+                First_.Get().~TType();
+                Last_.Get().~TType();
+                Known_ = false;
+            }
+        }
+
+    public:
+        inline TBounds()
+            : Known_(false)
+        {
+        }
+
+        // Bounds are written over copies of the front element of non-empty
+        // range, which are discarded if the range has no bounds
+        explicit TBounds(const IRangeImpl<TType>* range)
+            : Known_(false)
+        {
+            if (!range->IsEmpty())
+            {
+                const TType front = range->Front();
+                Set(front, front);
+                if (!range->GetBounds(First_.Get(), Last_.Get()))
+                {
+                    Destroy();
+                }
+            }
+        }
+
+        inline TBounds(const TBounds& bounds)
+            : Known_(false)
+        {
+            if (bounds.Known_)
+            {
+                Set(bounds.GetFirst(), bounds.GetLast());
+            }
+        }
+
+        inline ~TBounds()
+        {
+            Destroy();
+        }
+
+        TBounds& operator =(const TBounds& bounds)
+        {
+            if (bounds.Known_)
+            {
+                Set(bounds.GetFirst(), bounds.GetLast());
+            }
+            else
+            {
+                Destroy();
+            }
+            return *this;
+        }
+
+        inline void Set(const TType& first, const TType& last)
+        {
+            if (Known_)
+            {
+                First_.Get() = first;
+                Last_.Get() = last;
+            }
+            else
+            {
+                new (First_.Data_) TType(first);
+                new (Last_.Data_) TType(last);
+                Known_ = true;
+            }
+        }
+
+        inline bool IsKnown() const
+        {
+            return Known_;
+        }
+
+        inline const TType& GetFirst() const
+        {
+            return First_.Get();
+        }
+
+        inline const TType& GetLast() const
+        {
+            return Last_.Get();
+        }
+
+        inline bool Get(const IRangeImpl<TType>& range, TType& first,
+            TType& last) const
+        {
+            if (!Known_ || range.IsEmpty())
+            {
+                return false;
+            }
+            first = range.Front();
+            last = GetLast();
+            return true;
+        }
+
+        // Checks that all elements precede elements of bounds
+        template <class TCompare>
+        inline bool Precedes(const TBounds& bounds, TCompare& compare) const
+        {
+            return Known_ && bounds.Known_
+                && TStrictWeakOrder<TCompare>::Less(compare, GetLast(),
+                    bounds.GetFirst());
+        }
+    };
+
+    // Bounds of merge of two sorted ranges
+    template <class TType, class TCompare>
+    static TBounds<TType> UniteBounds(const TBounds<TType>& lhs,
+        const TBounds<TType>& rhs, TCompare& compare)
+    {
+        TBounds<TType> result;
+        if (lhs.IsKnown() && rhs.IsKnown())
+        {
+            result.Set(TStrictWeakOrder<TCompare>::Less(compare,
+                    rhs.GetFirst(), lhs.GetFirst())
+                    ? rhs.GetFirst() : lhs.GetFirst(),
+                TStrictWeakOrder<TCompare>::Less(compare, lhs.GetLast(),
+                    rhs.GetLast()) ? rhs.GetLast() : lhs.GetLast());
+        }
+        return result;
+    }
+
+    template <class TType>
+    class TConcatenatedRangesImpl: public IRangeImpl<TType>
+    {
+        IRangeImpl<TType>* const First_;
+        IRangeImpl<TType>* const Second_;
+        IRangeImpl<TType>* ActiveRange_;
+        TBounds<TType> Bounds_;
+
+        // Bounds in the range order
+        void FindBounds()
+        {
+            const TBounds<TType> first(First_);
+            const TBounds<TType> second(Second_);
+            if (first.IsKnown() && second.IsKnown())
+            {
+                Bounds_.Set(first.GetFirst(), second.GetLast());
+            }
+        }
+
+        template <class TAssert>
+        TConcatenatedRangesImpl(TRange<TType, TAssert>& first,
+            TRange<TType, TAssert>& second);
+
+    public:
+        template <class TAssert>
+        TConcatenatedRangesImpl(IRangeImpl<TType>* first,
+            TRange<TType, TAssert>& second);
+
+        inline ~TConcatenatedRangesImpl()
+        {
+            delete First_;
+            delete Second_;
+        }
+
+        inline bool IsEmpty() const
+        {
+            return ActiveRange_->IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            ActiveRange_->Pop();
+            if (ActiveRange_->IsEmpty())
+            {
+                ActiveRange_ = Second_;
+            }
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = ActiveRange_->Read(buffer, size);
+            if (ActiveRange_->IsEmpty() && ActiveRange_ != Second_)
+            {
+                ActiveRange_ = Second_;
+                count += Second_->Read(buffer + count, size - count);
+            }
+            return count;
+        }
+
+        inline TType Front() const
+        {
+            return ActiveRange_->Front();
+        }
+
+        bool EstimateSize(std::size_t& size) const
+        {
+            if (ActiveRange_ == Second_)
+            {
+                return Second_->EstimateSize(size);
+            }
+            else
+            {
+                return EstimateSum<TType>(First_, Second_, size);
+            }
+        }
+
+        // Sums sizes of remaining parts found with getSize
+        bool SumSizes(bool (IRangeImpl<TType>::*getSize)(std::size_t&) const,
+            std::size_t& size) const
+        {
+            std::size_t second;
+            if (!(Second_->*getSize)(second))
+            {
+                return false;
+            }
+            else if (ActiveRange_ == Second_)
+            {
+                size = second;
+                return true;
+            }
+            else if ((First_->*getSize)(size))
+            {
+                size += second;
+                return true;
+            }
+            return false;
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return SumSizes(&IRangeImpl<TType>::GetSize, size);
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return SumSizes(&IRangeImpl<TType>::GetKnownSize, size);
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return (ActiveRange_ == Second_ || First_->MergeSketch(sketch))
+                && Second_->MergeSketch(sketch);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Bounds_.Get(*this, first, last);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TConcatenatedRangesImpl& from =
+                static_cast<const TConcatenatedRangesImpl&>(source);
+            if (!RewindRange(First_, *from.First_)
+                || !RewindRange(Second_, *from.Second_))
+            {
+                return false;
+            }
+            ActiveRange_ = from.ActiveRange_ == from.First_ ? First_ : Second_;
+            Bounds_ = from.Bounds_;
+            return true;
+        }
+
+        IRangeImpl<TType>* Clone() const;
+    };
+
+    template <class TType, class TCompare>
+    class TUnitedRangesImpl: public IRangeImpl<TType>
+    {
+        TRangeHead<TType> First_;
+        TRangeHead<TType> Second_;
+        TCompare Compare_;
+        TFingerprint Operands_;
+        TOperandsIdentity Identity_;
+        TBounds<TType> Bounds_;
+        // Operand, which elements precede elements of another one, if any,
+        // so that merge is concatenation
+        TRangeHead<TType>* Leading_;
+        TRangeHead<TType>* ActiveRange_;
+        bool PopBoth_;
+
+        void FindBounds()
+        {
+            const TBounds<TType> first(First_.Get());
+            const TBounds<TType> second(Second_.Get());
+            Bounds_ = UniteBounds(first, second, Compare_);
+            Leading_ = first.Precedes(second, Compare_) ? &First_
+                : second.Precedes(first, Compare_) ? &Second_ : 0;
+        }
+
+        void Next()
+        {
+            PopBoth_ = false;
+            if (First_.IsEmpty())
+            {
+                ActiveRange_ = &Second_;
+            }
+            else if (Second_.IsEmpty())
+            {
+                ActiveRange_ = &First_;
+            }
+            else if (Leading_)
+            {
+                ActiveRange_ = Leading_;
+            }
+            else
+            {
+                const int order = TThreeWay<TCompare>::Compare(Compare_,
+                    First_.Front(), Second_.Front());
+                ActiveRange_ = order < 0 ? &First_ : &Second_;
+                PopBoth_ = !order;
+            }
+        }
+
+        template <class TAssert>
+        TUnitedRangesImpl(TRange<TType, TAssert>& first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+
+        friend class TArenaAllocated<TUnitedRangesImpl>;
+
+    public:
+        template <class TAssert>
+        TUnitedRangesImpl(IRangeImpl<TType>* first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+        inline bool IsEmpty() const
+        {
+            return First_.IsEmpty() && Second_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Operands_ = 0;
+            if (PopBoth_)
+            {
+                First_.Pop();
+                Second_.Pop();
+            }
+            else
+            {
+                ActiveRange_->Pop();
+            }
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return ActiveRange_->Front();
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            static const char kind = 0;
+            return CombineFingerprints(AddressFingerprint(&kind), Operands_);
+        }
+
+        inline TFingerprint GetOperands() const
+        {
+            return Operands_;
+        }
+
+        inline const TOperandsIdentity& GetIdentity() const
+        {
+            return Identity_;
+        }
+
+        inline bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            return SameOperands(*this, range);
+        }
+
+        inline const IRangeImpl<TType>* GetFirst() const
+        {
+            return First_.Get();
+        }
+
+        inline const IRangeImpl<TType>* GetSecond() const
+        {
+            return Second_.Get();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return EstimateSum(First_.Get(), Second_.Get(), size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return CountSequences(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Union_, size);
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return First_.Get()->MergeSketch(sketch)
+                && Second_.Get()->MergeSketch(sketch);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Bounds_.Get(*this, first, last);
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            return program.AddOperation(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Union_);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TUnitedRangesImpl& from =
+                static_cast<const TUnitedRangesImpl&>(source);
+            if (!First_.Rewind(from.First_) || !Second_.Rewind(from.Second_))
+            {
+                return false;
+            }
+            Operands_ = from.Operands_;
+            Identity_ = from.Identity_;
+            Bounds_ = from.Bounds_;
+            Leading_ = !from.Leading_ ? 0
+                : from.Leading_ == &from.First_ ? &First_ : &Second_;
+            ActiveRange_ =
+                from.ActiveRange_ == &from.First_ ? &First_ : &Second_;
+            PopBoth_ = from.PopBoth_;
+            return true;
+        }
+
+        // Copies node from arena, if it is given, otherwise on heap
+        IRangeImpl<TType>* Copy(TArena* arena) const;
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return Copy(0);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TArena& arena) const
+        {
+            return Copy(&arena);
+        }
+    };
+
+    template <class TType, class TCompare>
+    class TIntersectedRangesImpl: public IRangeImpl<TType>
+    {
+        TRangeHead<TType> First_;
+        TRangeHead<TType> Second_;
+        TCompare Compare_;
+        TFingerprint Operands_;
+        TOperandsIdentity Identity_;
+        TBounds<TType> Bounds_;
+
+        void FindBounds()
+        {
+            const TBounds<TType> first(First_.Get());
+            const TBounds<TType> second(Second_.Get());
+            if (first.IsKnown() && second.IsKnown())
+            {
+                Bounds_.Set(TStrictWeakOrder<TCompare>::Less(Compare_,
+                        first.GetFirst(), second.GetFirst())
+                        ? second.GetFirst() : first.GetFirst(),
+                    TStrictWeakOrder<TCompare>::Less(Compare_,
+                        second.GetLast(), first.GetLast())
+                        ? second.GetLast() : first.GetLast());
+            }
+        }
+
+        void Next()
+        {
+            while (!IsEmpty())
+            {
+                const int order = TThreeWay<TCompare>::Compare(Compare_,
+                    First_.Front(), Second_.Front());
+                if (order < 0)
+                {
+                    First_.SkipTo(Second_.Front(), Compare_);
+                }
+                else if (order > 0)
+                {
+                    Second_.SkipTo(First_.Front(), Compare_);
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        template <class TAssert>
+        TIntersectedRangesImpl(TRange<TType, TAssert>& first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+
+        friend class TArenaAllocated<TIntersectedRangesImpl>;
+
+    public:
+        template <class TAssert>
+        TIntersectedRangesImpl(IRangeImpl<TType>* first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+        inline bool IsEmpty() const
+        {
+            return First_.IsEmpty() || Second_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Operands_ = 0;
+            First_.Pop();
+            Second_.Pop();
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return First_.Front();
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            static const char kind = 0;
+            return CombineFingerprints(AddressFingerprint(&kind), Operands_);
+        }
+
+        inline TFingerprint GetOperands() const
+        {
+            return Operands_;
+        }
+
+        inline const TOperandsIdentity& GetIdentity() const
+        {
+            return Identity_;
+        }
+
+        inline bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            return SameOperands(*this, range);
+        }
+
+        inline const IRangeImpl<TType>* GetFirst() const
+        {
+            return First_.Get();
+        }
+
+        inline const IRangeImpl<TType>* GetSecond() const
+        {
+            return Second_.Get();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return EstimateMin(First_.Get(), Second_.Get(), size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return CountSequences(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Intersection_, size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Bounds_.Get(*this, first, last);
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            return program.AddOperation(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Intersection_);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TIntersectedRangesImpl& from =
+                static_cast<const TIntersectedRangesImpl&>(source);
+            if (!First_.Rewind(from.First_) || !Second_.Rewind(from.Second_))
+            {
+                return false;
+            }
+            Operands_ = from.Operands_;
+            Identity_ = from.Identity_;
+            Bounds_ = from.Bounds_;
+            return true;
+        }
+
+        // Copies node from arena, if it is given, otherwise on heap
+        IRangeImpl<TType>* Copy(TArena* arena) const;
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return Copy(0);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TArena& arena) const
+        {
+            return Copy(&arena);
+        }
+    };
+
+    template <class TType, class TCompare>
+    class TComplementedRangesImpl: public IRangeImpl<TType>
+    {
+        TRangeHead<TType> First_;
+        TRangeHead<TType> Second_;
+        TCompare Compare_;
+        TFingerprint Operands_;
+        TOperandsIdentity Identity_;
+        TBounds<TType> Bounds_;
+
+        void Next()
+        {
+            while (!IsEmpty() && !Second_.IsEmpty())
+            {
+                const int order = TThreeWay<TCompare>::Compare(Compare_,
+                    First_.Front(), Second_.Front());
+                if (order < 0)
+                {
+                    break;
+                }
+                else if (order > 0)
+                {
+                    Second_.SkipTo(First_.Front(), Compare_);
+                }
+                else
+                {
+                    First_.Pop();
+                    Second_.Pop();
+                }
+            }
+        }
+
+        template <class TAssert>
+        TComplementedRangesImpl(TRange<TType, TAssert>& first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+
+        friend class TArenaAllocated<TComplementedRangesImpl>;
+
+    public:
+        template <class TAssert>
+        TComplementedRangesImpl(IRangeImpl<TType>* first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+        inline bool IsEmpty() const
+        {
+            return First_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Operands_ = 0;
+            First_.Pop();
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return First_.Front();
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            static const char kind = 0;
+            return CombineFingerprints(AddressFingerprint(&kind), Operands_);
+        }
+
+        bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            const TComplementedRangesImpl* complement =
+                dynamic_cast<const TComplementedRangesImpl*>(&range);
+            return complement && Operands_ && complement->Operands_
+                && Identity_.Fingerprints_[0]
+                    == complement->Identity_.Fingerprints_[0]
+                && Identity_.Fingerprints_[1]
+                    == complement->Identity_.Fingerprints_[1];
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return First_.Get()->EstimateSize(size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return CountSequences(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Difference_, size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Bounds_.Get(*this, first, last);
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            return program.AddOperation(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::Difference_);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TComplementedRangesImpl& from =
+                static_cast<const TComplementedRangesImpl&>(source);
+            if (!First_.Rewind(from.First_) || !Second_.Rewind(from.Second_))
+            {
+                return false;
+            }
+            Operands_ = from.Operands_;
+            Identity_ = from.Identity_;
+            Bounds_ = from.Bounds_;
+            return true;
+        }
+
+        // Copies node from arena, if it is given, otherwise on heap
+        IRangeImpl<TType>* Copy(TArena* arena) const;
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return Copy(0);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TArena& arena) const
+        {
+            return Copy(&arena);
+        }
+    };
+
+    template <class TType, class TCompare>
+    class TSymmetricDifferenceImpl: public IRangeImpl<TType>
+    {
+        TRangeHead<TType> First_;
+        TRangeHead<TType> Second_;
+        TCompare Compare_;
+        TFingerprint Operands_;
+        TOperandsIdentity Identity_;
+        TBounds<TType> Bounds_;
+        // Operand, which elements precede elements of another one, if any
+        TRangeHead<TType>* Leading_;
+        TRangeHead<TType>* ActiveRange_;
+
+        void FindBounds()
+        {
+            const TBounds<TType> first(First_.Get());
+            const TBounds<TType> second(Second_.Get());
+            Bounds_ = UniteBounds(first, second, Compare_);
+            Leading_ = first.Precedes(second, Compare_) ? &First_
+                : second.Precedes(first, Compare_) ? &Second_ : 0;
+        }
+
+        TRangeHead<TType>* Next()
+        {
+            while (!First_.IsEmpty())
+            {
+                if (Second_.IsEmpty())
+                {
+                    return &First_;
+                }
+                else if (Leading_)
+                {
+                    return Leading_;
+                }
+                const int order = TThreeWay<TCompare>::Compare(Compare_,
+                    First_.Front(), Second_.Front());
+                if (order < 0)
+                {
+                    return &First_;
+                }
+                else if (order > 0)
+                {
+                    return &Second_;
+                }
+                First_.Pop();
+                Second_.Pop();
+            }
+            return &Second_;
+        }
+
+        template <class TAssert>
+        TSymmetricDifferenceImpl(TRange<TType, TAssert>& first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+
+        friend class TArenaAllocated<TSymmetricDifferenceImpl>;
+
+    public:
+        template <class TAssert>
+        TSymmetricDifferenceImpl(IRangeImpl<TType>* first,
+            TRange<TType, TAssert>& second, TCompare compare);
+
+        inline bool IsEmpty() const
+        {
+            return First_.IsEmpty() && Second_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Operands_ = 0;
+            ActiveRange_->Pop();
+            ActiveRange_ = Next();
+        }
+
+        inline TType Front() const
+        {
+            return ActiveRange_->Front();
+        }
+
+        inline TFingerprint Fingerprint() const
+        {
+            static const char kind = 0;
+            return CombineFingerprints(AddressFingerprint(&kind), Operands_);
+        }
+
+        inline TFingerprint GetOperands() const
+        {
+            return Operands_;
+        }
+
+        inline const TOperandsIdentity& GetIdentity() const
+        {
+            return Identity_;
+        }
+
+        inline bool IsSameExpression(const IRangeImpl<TType>& range) const
+        {
+            return SameOperands(*this, range);
+        }
+
+        inline const IRangeImpl<TType>* GetFirst() const
+        {
+            return First_.Get();
+        }
+
+        inline const IRangeImpl<TType>* GetSecond() const
+        {
+            return Second_.Get();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return EstimateSum(First_.Get(), Second_.Get(), size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return CountSequences(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::SymmetricDifference_, size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Bounds_.Get(*this, first, last);
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            return program.AddOperation(First_.Get(), Second_.Get(), Compare_,
+                TSetOperation::SymmetricDifference_);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TSymmetricDifferenceImpl& from =
+                static_cast<const TSymmetricDifferenceImpl&>(source);
+            if (!First_.Rewind(from.First_) || !Second_.Rewind(from.Second_))
+            {
+                return false;
+            }
+            Operands_ = from.Operands_;
+            Identity_ = from.Identity_;
+            Bounds_ = from.Bounds_;
+            Leading_ = !from.Leading_ ? 0
+                : from.Leading_ == &from.First_ ? &First_ : &Second_;
+            ActiveRange_ =
+                from.ActiveRange_ == &from.First_ ? &First_ : &Second_;
+            return true;
+        }
+
+        // Copies node from arena, if it is given, otherwise on heap
+        IRangeImpl<TType>* Copy(TArena* arena) const;
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return Copy(0);
+        }
+
+        inline IRangeImpl<TType>* CloneTo(TArena& arena) const
+        {
+            return Copy(&arena);
+        }
+    };
+
+    // Emits elements found in at least K_ of sorted ranges. Heads are kept
+    // ordered, so that K_-th head is pivot: no element less than pivot can be
+    // found in K_ ranges, so all ranges behind it skip straight to pivot.
+    template <class TType, class TCompare>
+    class TThresholdRangesImpl: public IRangeImpl<TType>
+    {
+        typedef std::vector<TRangeHead<TType>*> THeads_;
+
+        class THeadLess_
+        {
+            TCompare& Compare_;
+
+        public:
+            inline explicit THeadLess_(TCompare& compare)
+                : Compare_(compare)
+            {
+            }
+
+            inline bool operator ()(const TRangeHead<TType>* lhs,
+                const TRangeHead<TType>* rhs) const
+            {
+                return TStrictWeakOrder<TCompare>::Less(Compare_,
+                    lhs->Front(), rhs->Front());
+            }
+        };
+
+        THeads_ Heads_;
+        const std::size_t K_;
+        TCompare Compare_;
+        TType Front_;
+        bool Empty_;
+
+        inline bool Less(const TType& lhs, const TType& rhs)
+        {
+            return TStrictWeakOrder<TCompare>::Less(Compare_, lhs, rhs);
+        }
+
+        // First heads up to advanced were moved forward, while the rest of
+        // them are still ordered, so only moved heads are put back in place
+        void Arrange(std::size_t advanced)
+        {
+            const THeadLess_ less(Compare_);
+            for (std::size_t i = advanced; i--; )
+            {
+                const typename THeads_::iterator head = Heads_.begin() + i;
+                if ((*head)->IsEmpty())
+                {
+                    delete *head;
+                    Heads_.erase(head);
+                }
+                else
+                {
+                    std::rotate(head, head + 1,
+                        std::upper_bound(head + 1, Heads_.end(), *head, less));
+                }
+            }
+        }
+
+        void Next()
+        {
+            while (Heads_.size() >= K_)
+            {
+                const TType pivot = Heads_[K_ - 1]->Front();
+                if (!Less(Heads_.front()->Front(), pivot))
+                {
+                    Front_ = pivot;
+                    return;
+                }
+                std::size_t i = 0;
+                for (; i < K_ - 1 && Less(Heads_[i]->Front(), pivot); ++i)
+                {
+                    Heads_[i]->SkipTo(pivot, Compare_);
+                }
+                Arrange(i);
+            }
+            Empty_ = true;
+        }
+
+        inline explicit TThresholdRangesImpl(
+            const TThresholdRangesImpl* range)
+            : K_(range->K_)
+            , Compare_(range->Compare_)
+            , Front_(range->Front_)
+            , Empty_(range->Empty_)
+        {
+            Heads_.reserve(range->Heads_.size());
+            for (std::size_t i = 0; i < range->Heads_.size(); ++i)
+            {
+                Heads_.push_back(0);
+                Heads_.back() =
+                    new TRangeHead<TType>(range->Heads_[i]->Clone());
+            }
+        }
+
+    public:
+        template <class TInputIterator>
+        TThresholdRangesImpl(TInputIterator first, TInputIterator last,
+            std::size_t k, TCompare compare);
+
+        inline ~TThresholdRangesImpl()
+        {
+            for (std::size_t i = 0; i < Heads_.size(); ++i)
+            {
+                delete Heads_[i];
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Empty_;
+        }
+
+        void Pop()
+        {
+            std::size_t i = 0;
+            for (; i < Heads_.size() && !Less(Front_, Heads_[i]->Front()); ++i)
+            {
+                do
+                {
+                    Heads_[i]->Pop();
+                }
+                while (!Heads_[i]->IsEmpty()
+                    && !Less(Front_, Heads_[i]->Front()));
+            }
+            Arrange(i);
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return Front_;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TThresholdRangesImpl(this);
+        }
+    };
+
+    // Elements of sorted range not found in any of sorted exclusion ranges.
+    // Exclusion heads are kept in heap and each of them is skipped forward
+    // only as far as the current element, so exclusion elements which fall
+    // between elements of range are never merged.
+    template <class TType, class TCompare>
+    class TComplementAllImpl: public IRangeImpl<TType>
+    {
+        typedef std::vector<TRangeHead<TType>*> THeads_;
+
+        // Orders heap with the least head on top
+        class THeadGreater_
+        {
+            TCompare& Compare_;
+
+        public:
+            inline explicit THeadGreater_(TCompare& compare)
+                : Compare_(compare)
+            {
+            }
+
+            inline bool operator ()(const TRangeHead<TType>* lhs,
+                const TRangeHead<TType>* rhs) const
+            {
+                return TStrictWeakOrder<TCompare>::Less(Compare_,
+                    rhs->Front(), lhs->Front());
+            }
+        };
+
+        TRangeHead<TType> Range_;
+        THeads_ Heads_;
+        TCompare Compare_;
+
+        inline bool Less(const TType& lhs, const TType& rhs)
+        {
+            return TStrictWeakOrder<TCompare>::Less(Compare_, lhs, rhs);
+        }
+
+        void Next()
+        {
+            while (!Range_.IsEmpty() && !Heads_.empty())
+            {
+                TRangeHead<TType>* head = Heads_.front();
+                if (Less(head->Front(), Range_.Front()))
+                {
+                    std::pop_heap(Heads_.begin(), Heads_.end(),
+                        THeadGreater_(Compare_));
+                    head->SkipTo(Range_.Front(), Compare_);
+                    if (head->IsEmpty())
+                    {
+                        delete head;
+                        Heads_.pop_back();
+                    }
+                    else
+                    {
+                        std::push_heap(Heads_.begin(), Heads_.end(),
+                            THeadGreater_(Compare_));
+                    }
+                }
+                else if (Less(Range_.Front(), head->Front()))
+                {
+                    break;
+                }
+                else
+                {
+                    Match();
+                }
+            }
+        }
+
+        // Removes the current element along with one element of union of
+        // exclusion ranges, which takes one element from each head equal to
+        // it, as merge of these ranges would do
+        void Match()
+        {
+            const THeadGreater_ greater(Compare_);
+            const TType value = Range_.Front();
+            Range_.Pop();
+            std::size_t size = Heads_.size();
+            while (size && !Less(value, Heads_.front()->Front()))
+            {
+                std::pop_heap(Heads_.begin(), Heads_.begin() + size, greater);
+                --size;
+            }
+
+            std::size_t last = size;
+            for (std::size_t i = size; i < Heads_.size(); ++i)
+            {
+                Heads_[i]->Pop();
+                if (Heads_[i]->IsEmpty())
+                {
+                    delete Heads_[i];
+                }
+                else
+                {
+                    Heads_[last] = Heads_[i];
+                    std::push_heap(Heads_.begin(), Heads_.begin() + ++last,
+                        greater);
+                }
+            }
+            Heads_.resize(last);
+        }
+
+        inline explicit TComplementAllImpl(const TComplementAllImpl* range)
+            : Range_(range->Range_.Clone())
+            , Compare_(range->Compare_)
+        {
+            Heads_.reserve(range->Heads_.size());
+            for (std::size_t i = 0; i < range->Heads_.size(); ++i)
+            {
+                Heads_.push_back(0);
+                Heads_.back() =
+                    new TRangeHead<TType>(range->Heads_[i]->Clone());
+            }
+        }
+
+    public:
+        template <class TInputIterator>
+        TComplementAllImpl(IRangeImpl<TType>* range, TInputIterator first,
+            TInputIterator last, TCompare compare);
+
+        inline ~TComplementAllImpl()
+        {
+            for (std::size_t i = 0; i < Heads_.size(); ++i)
+            {
+                delete Heads_[i];
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Range_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Range_.Pop();
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return Range_.Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_.Get()->EstimateSize(size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Range_.Get()->GetBounds(first, last);
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TComplementAllImpl(this);
+        }
+    };
+
+    template <class TType, class TCompare>
+    class TUniqueRangeImpl: public IRangeImpl<TType>
+    {
+        TRangeHead<TType> Range_;
+        TCompare Compare_;
+
+        template <class TAssert>
+        TUniqueRangeImpl(TRange<TType, TAssert>& range, TCompare compare);
+
+    public:
+        inline TUniqueRangeImpl(IRangeImpl<TType>* range, TCompare compare)
+            : Range_(range)
+            , Compare_(compare)
+        {
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Range_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            TType val = Range_.Front();
+            do {
+                Range_.Pop();
+            } while (!Range_.IsEmpty() && Compare_(val, Range_.Front()));
+        }
+
+        inline TType Front() const
+        {
+            return Range_.Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_.Get()->EstimateSize(size);
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return Range_.Get()->MergeSketch(sketch);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Range_.Get()->GetBounds(first, last);
+        }
+
+        inline bool Compile(TProgram<TType>& program) const
+        {
+            return program.AddFilter(Range_.Get(),
+                TUniqueFilter<TType, TCompare>(Compare_));
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TUniqueRangeImpl& from =
+                static_cast<const TUniqueRangeImpl&>(source);
+            return Range_.Rewind(from.Range_);
+        }
+
+        IRangeImpl<TType>* Clone() const;
+    };
 
-            if (First_->IsEmpty())
+    // Emits first occurrences of values in input order. Seen values are kept
+    // in hash set of at most tableLimit bytes. When the set is about to grow
+    // beyond it, its values are spilled to a sorted run in memory, and runs
+    // of similar size are merged, so that there are logarithmically many of
+    // them. Runs are immutable and shared between copies. Only the hash set
+    // is bounded, the runs hold every distinct value seen so far.
+    template <class TType, class THashFunc, class TCompare>
+    class TDistinctRangeImpl: public IRangeImpl<TType>
+    {
+        typedef THashSet<TType, THashFunc, TEquivalent<TCompare> > TSet_;
+
+        class TSharedRun_
+        {
+            std::vector<TType> Data_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+#else
+            unsigned Counter_;
+#endif
+
+        public:
+            // Takes contents of data away
+            inline explicit TSharedRun_(std::vector<TType>& data)
+                : Counter_(1)
             {
-                ActiveRange_ = Second_;
+                Data_.swap(data);
             }
-            else if (Second_->IsEmpty())
+
+            inline void IncreaseCounter()
             {
-                ActiveRange_ = First_;
+                ++Counter_;
             }
-            else if (Compare_(First_->Front(), Second_->Front()))
+
+            inline void Release()
             {
-                ActiveRange_ = First_;
+                if (!--Counter_)
+                {
+                    delete this;
+                }
             }
-            else
+
+            inline const std::vector<TType>& GetData() const
             {
-                ActiveRange_ = Second_;
-                if (!Compare_(Second_->Front(), First_->Front()))
+                return Data_;
+            }
+        };
+
+        typedef std::vector<TSharedRun_*> TRuns_;
+
+        TRangeHead<TType> Range_;
+        TSet_ Seen_;
+        // Runs go from the largest to the smallest
+        TRuns_ Runs_;
+        TCompare Compare_;
+        const std::size_t TableLimit_;
+
+        bool Spilled(const TType& value) const
+        {
+            for (typename TRuns_::const_iterator iter = Runs_.begin();
+                iter != Runs_.end(); ++iter)
+            {
+                const std::vector<TType>& data = (*iter)->GetData();
+                if (std::binary_search(data.begin(), data.end(), value,
+                    Compare_))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void Spill()
+        {
+            std::vector<TType> values;
+            values.reserve(Seen_.Size());
+            Seen_.CopyTo(std::back_inserter(values));
+            Seen_.Clear();
+            std::sort(values.begin(), values.end(), Compare_);
+            while (!Runs_.empty()
+                && Runs_.back()->GetData().size() <= 2 * values.size())
+            {
+                const std::vector<TType>& last = Runs_.back()->GetData();
+                std::vector<TType> run;
+                run.reserve(last.size() + values.size());
+                std::merge(last.begin(), last.end(), values.begin(),
+                    values.end(), std::back_inserter(run), Compare_);
+                values.swap(run);
+                Runs_.back()->Release();
+                Runs_.pop_back();
+            }
+            Runs_.push_back(0);
+            Runs_.back() = new TSharedRun_(values);
+        }
+
+        void Next()
+        {
+            while (!Range_.IsEmpty())
+            {
+                const TType& value = Range_.Front();
+                if (Seen_.Contains(value) || Spilled(value))
                 {
-                    PopBoth_ = true;
+                    Range_.Pop();
                 }
+                else
+                {
+                    if (Seen_.NeedsGrow()
+                        && Seen_.GetMemoryUsage() * 2 > TableLimit_)
+                    {
+                        Spill();
+                    }
+                    Seen_.Insert(value);
+                    break;
+                }
+            }
+        }
+
+        template <class TAssert>
+        TDistinctRangeImpl(TRange<TType, TAssert>& range,
+            const TDistinctRangeImpl& state);
+
+    public:
+        inline TDistinctRangeImpl(IRangeImpl<TType>* range, THashFunc hash,
+            TCompare compare, std::size_t tableLimit)
+            : Range_(range)
+            , Seen_(hash, TEquivalent<TCompare>(compare))
+            , Compare_(compare)
+            , TableLimit_(tableLimit)
+        {
+            Next();
+        }
+
+        inline ~TDistinctRangeImpl()
+        {
+            for (std::size_t i = 0; i < Runs_.size(); ++i)
+            {
+                Runs_[i]->Release();
             }
         }
 
+        inline bool IsEmpty() const
+        {
+            return Range_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Range_.Pop();
+            Next();
+        }
+
         inline TType Front() const
         {
-            return ActiveRange_->Front();
+            return Range_.Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_.Get()->EstimateSize(size);
+        }
+
+        inline bool MergeSketch(TSketch& sketch) const
+        {
+            return Range_.Get()->MergeSketch(sketch);
         }
 
         IRangeImpl<TType>* Clone() const;
     };
 
-    template <class TType, class TCompare>
-    class TIntersectedRangesImpl: public IRangeImpl<TType>
+    // Streams probe range keeping elements which are present (or absent) in
+    // build range. Build range is loaded into hash table once and the table
+    // is shared between copies, so probe order and duplicates are preserved
+    // and inputs need not be sorted.
+    template <class TType, class THashFunc, class TCompare>
+    class THashJoinImpl: public IRangeImpl<TType>
     {
-        IRangeImpl<TType>* const First_;
-        IRangeImpl<TType>* const Second_;
-        TCompare Compare_;
+        typedef THashSet<TType, THashFunc, TEquivalent<TCompare> > TSet_;
 
-        void Next()
+        class TSharedTable_
         {
-            while (!IsEmpty())
+            TSet_ Set_;
+#if __cplusplus >= 201103L
+            std::atomic<unsigned> Counter_;
+#else
+            unsigned Counter_;
+#endif
+
+        public:
+            inline TSharedTable_(IRangeImpl<TType>* build, THashFunc hash,
+                TCompare compare)
+                : Set_(hash, TEquivalent<TCompare>(compare))
+                , Counter_(1)
             {
-                if (Compare_(First_->Front(), Second_->Front()))
+                for (; !build->IsEmpty(); build->Pop())
                 {
-                    First_->Pop();
+                    Set_.Insert(build->Front());
                 }
-                else if (Compare_(Second_->Front(), First_->Front()))
-                {
-                    Second_->Pop();
-                }
-                else
+                delete build;
+            }
+
+            inline void IncreaseCounter()
+            {
+                ++Counter_;
+            }
+
+            inline unsigned DecreaseCounter()
+            {
+                return --Counter_;
+            }
+
+            inline bool Contains(const TType& value) const
+            {
+                return Set_.Contains(value);
+            }
+        };
+
+        TSharedTable_* const Table_;
+        TRangeHead<TType> Probe_;
+        const bool Matching_;
+
+        void Next()
+        {
+            while (!Probe_.IsEmpty()
+                && Table_->Contains(Probe_.Front()) != Matching_)
+            {
+                Probe_.Pop();
+            }
+        }
+
+        template <class TAssert>
+        THashJoinImpl(TRange<TType, TAssert>& probe,
+            const THashJoinImpl& join);
+
+    public:
+        inline THashJoinImpl(IRangeImpl<TType>* probe,
+            IRangeImpl<TType>* build, THashFunc hash, TCompare compare,
+            bool matching)
+            : Table_(new TSharedTable_(build, hash, compare))
+            , Probe_(probe)
+            , Matching_(matching)
+        {
+            Next();
+        }
+
+        inline ~THashJoinImpl()
+        {
+            if (!Table_->DecreaseCounter())
+            {
+                delete Table_;
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Probe_.IsEmpty();
+        }
+
+        inline void Pop()
+        {
+            Probe_.Pop();
+            Next();
+        }
+
+        inline TType Front() const
+        {
+            return Probe_.Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Probe_.Get()->EstimateSize(size);
+        }
+
+        IRangeImpl<TType>* Clone() const;
+    };
+
+    template <class TType, class TPredicate>
+    class TRemoveImpl: public IRangeImpl<TType>
+    {
+        IRangeImpl<TType>* const Range_;
+        TPredicate Predicate_;
+        // Predicates of Remove calls fused into this node
+        std::vector<TPredicate> Fused_;
+
+        bool Removes(const TType& value)
+        {
+            if (Predicate_(value))
+            {
+                return true;
+            }
+            for (typename std::vector<TPredicate>::iterator iter =
+                Fused_.begin(); iter != Fused_.end(); ++iter)
+            {
+                if ((*iter)(value))
                 {
-                    break;
+                    return true;
                 }
             }
+            return false;
+        }
+
+        void Next()
+        {
+            while (!Range_->IsEmpty() && Removes(Range_->Front()))
+            {
+                Range_->Pop();
+            }
         }
 
         template <class TAssert>
-        TIntersectedRangesImpl(TRange<TType, TAssert>& first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        TRemoveImpl(TRange<TType, TAssert>& range, TPredicate predicate);
 
     public:
-        template <class TAssert>
-        TIntersectedRangesImpl(IRangeImpl<TType>* first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        inline TRemoveImpl(IRangeImpl<TType>* range, TPredicate predicate)
+            : Range_(range)
+            , Predicate_(predicate)
+        {
+            Next();
+        }
 
-        inline ~TIntersectedRangesImpl()
+        inline ~TRemoveImpl()
         {
-            delete First_;
-            delete Second_;
+            delete Range_;
+        }
+
+        // Removes elements matching predicate as well
+        inline void Fuse(TPredicate predicate)
+        {
+            Fused_.push_back(predicate);
+            Next();
         }
 
         inline bool IsEmpty() const
         {
-            return First_->IsEmpty() || Second_->IsEmpty();
+            return Range_->IsEmpty();
         }
 
         inline void Pop()
         {
-            First_->Pop();
-            Second_->Pop();
+            Range_->Pop();
             Next();
         }
 
         inline TType Front() const
         {
-            return First_->Front();
+            return Range_->Front();
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_->EstimateSize(size);
+        }
+
+        inline bool GetBounds(TType& first, TType& last) const
+        {
+            return Range_->GetBounds(first, last);
+        }
+
+        bool Compile(TProgram<TType>& program) const
+        {
+            if (!program.AddFilter(Range_,
+                TRemoveFilter<TType, TPredicate>(Predicate_)))
+            {
+                return false;
+            }
+            for (std::size_t i = 0; i < Fused_.size(); ++i)
+            {
+                program.AddFilter(
+                    TRemoveFilter<TType, TPredicate>(Fused_[i]));
+            }
+            return true;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TRemoveImpl& from =
+                static_cast<const TRemoveImpl&>(source);
+            return RewindRange(Range_, *from.Range_);
+        }
+
+        // Filters blocks of underlying range in place
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = 0;
+            while (count < size && !Range_->IsEmpty())
+            {
+                const std::size_t last =
+                    count + Range_->Read(buffer + count, size - count);
+                for (std::size_t i = count; i < last; ++i)
+                {
+                    if (!Removes(buffer[i]))
+                    {
+                        buffer[count++] = buffer[i];
+                    }
+                }
+            }
+            Next();
+            return count;
+        }
+
+        IRangeImpl<TType>* Clone() const;
+    };
+
+    // Ops of Transform calls fused into transform node, which is possible
+    // only if ops map values to the same type
+    template <class TType, class TOldType, class TUnaryOp>
+    class TFusedOps
+    {
+    public:
+        inline void Add(TUnaryOp)
+        {
+        }
+
+        inline TType Apply(TType value) const
+        {
+            return value;
+        }
+    };
+
+    template <class TType, class TUnaryOp>
+    class TFusedOps<TType, TType, TUnaryOp>
+    {
+        std::vector<TUnaryOp> Ops_;
+
+    public:
+        inline void Add(TUnaryOp op)
+        {
+            Ops_.push_back(op);
+        }
+
+        TType Apply(TType value) const
+        {
+            for (typename std::vector<TUnaryOp>::const_iterator iter =
+                Ops_.begin(); iter != Ops_.end(); ++iter)
+            {
+                value = (*iter)(value);
+            }
+            return value;
         }
-
-        IRangeImpl<TType>* Clone() const;
     };
 
-    template <class TType, class TCompare>
-    class TComplementedRangesImpl: public IRangeImpl<TType>
+    // Transformed range with filters fused in. Transformed value of the
+    // head is kept, so that op is invoked once per element.
+    template <class TType, class TOldType, class TUnaryOp>
+    class TFilteredTransformImpl: public IRangeImpl<TType>
     {
-        IRangeImpl<TType>* const First_;
-        IRangeImpl<TType>* const Second_;
-        TCompare Compare_;
+        typedef std::vector<IPredicate<TType>*> TPredicates_;
 
-        void Next()
+        IRangeImpl<TOldType>* const Range_;
+        TUnaryOp Op_;
+        TFusedOps<TType, TOldType, TUnaryOp> Fused_;
+        TPredicates_ Predicates_;
+        // Mapped front element which passes predicates, it is found on
+        // demand, so that block reads don't map the element after them
+        mutable TType Value_;
+        mutable bool Cached_;
+        TReadBlock<TOldType> Block_;
+
+        bool Removes(const TType& value) const
         {
-            while (!IsEmpty() && !Second_->IsEmpty())
+            for (typename TPredicates_::const_iterator iter =
+                Predicates_.begin();
+                iter != Predicates_.end(); ++iter)
             {
-                if (Compare_(First_->Front(), Second_->Front()))
+                if ((**iter)(value))
                 {
-                    break;
+                    return true;
                 }
-                else
+            }
+            return false;
+        }
+
+        void Next() const
+        {
+            while (!Cached_ && !Range_->IsEmpty())
+            {
+                Value_ = Fused_.Apply(Op_(Range_->Front()));
+                Cached_ = !Removes(Value_);
+                if (!Cached_)
                 {
-                    if (!Compare_(Second_->Front(), First_->Front()))
-                    {
-                        First_->Pop();
-                    }
-                    Second_->Pop();
+                    Range_->Pop();
                 }
             }
         }
 
-        template <class TAssert>
-        TComplementedRangesImpl(TRange<TType, TAssert>& first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        inline explicit TFilteredTransformImpl(
+            const TFilteredTransformImpl* range)
+            : Range_(range->Range_->Clone())
+            , Op_(range->Op_)
+            , Fused_(range->Fused_)
+            , Value_(range->Value_)
+            , Cached_(range->Cached_)
+        {
+            for (typename TPredicates_::const_iterator iter =
+                range->Predicates_.begin(); iter != range->Predicates_.end();
+                ++iter)
+            {
+                Predicates_.push_back((*iter)->Clone());
+            }
+        }
 
     public:
-        template <class TAssert>
-        TComplementedRangesImpl(IRangeImpl<TType>* first,
-            TRange<TType, TAssert>& second, TCompare compare);
+        inline TFilteredTransformImpl(IRangeImpl<TOldType>* range,
+            TUnaryOp op, const TFusedOps<TType, TOldType, TUnaryOp>& fused,
+            const IPredicate<TType>& predicate)
+            : Range_(range)
+            , Op_(op)
+            , Fused_(fused)
+            , Predicates_(1, predicate.Clone())
+            , Value_()
+            , Cached_(false)
+        {
+        }
 
-        inline ~TComplementedRangesImpl()
+        ~TFilteredTransformImpl()
         {
-            delete First_;
-            delete Second_;
+            for (typename TPredicates_::iterator iter = Predicates_.begin();
+                iter != Predicates_.end(); ++iter)
+            {
+                delete *iter;
+            }
+            delete Range_;
         }
 
         inline bool IsEmpty() const
         {
-            return First_->IsEmpty();
+            Next();
+            return Range_->IsEmpty();
         }
 
         inline void Pop()
         {
-            First_->Pop();
             Next();
+            Range_->Pop();
+            Cached_ = false;
         }
 
         inline TType Front() const
         {
-            return First_->Front();
+            Next();
+            return Value_;
         }
 
-        IRangeImpl<TType>* Clone() const;
-    };
-
-    template <class TType, class TCompare>
-    class TSymmetricDifferenceImpl: public IRangeImpl<TType>
-    {
-        IRangeImpl<TType>* const First_;
-        IRangeImpl<TType>* const Second_;
-        IRangeImpl<TType>* ActiveRange_;
-        TCompare Compare_;
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_->EstimateSize(size);
+        }
 
-        IRangeImpl<TType>* Next()
+        // Maps blocks of underlying range and filters them in place. Front
+        // element found already is taken first.
+        std::size_t Read(TType* buffer, std::size_t size)
         {
-            while (!First_->IsEmpty())
+            std::size_t count = 0;
+            if (size && !IsEmpty())
             {
-                if (Second_->IsEmpty())
-                {
-                    return First_;
-                }
-                else if (Compare_(First_->Front(), Second_->Front()))
+                buffer[count++] = Value_;
+                Range_->Pop();
+                Cached_ = false;
+            }
+            TOldType* block = Block_.Get();
+            while (count < size && !Range_->IsEmpty())
+            {
+                std::size_t chunk = size - count;
+                if (chunk > TReadBlock<TOldType>::Size_)
                 {
-                    return First_;
+                    chunk = TReadBlock<TOldType>::Size_;
                 }
-                else if (Compare_(Second_->Front(), First_->Front()))
+                const std::size_t read = Range_->Read(block, chunk);
+                for (std::size_t i = 0; i < read; ++i)
                 {
-                    return Second_;
+                    buffer[count] = Fused_.Apply(Op_(block[i]));
+                    if (!Removes(buffer[count]))
+                    {
+                        ++count;
+                    }
                 }
-                First_->Pop();
-                Second_->Pop();
             }
-            return Second_;
-        }
-
-        template <class TAssert>
-        TSymmetricDifferenceImpl(TRange<TType, TAssert>& first,
-            TRange<TType, TAssert>& second, TCompare compare);
-
-    public:
-        template <class TAssert>
-        TSymmetricDifferenceImpl(IRangeImpl<TType>* first,
-            TRange<TType, TAssert>& second, TCompare compare);
-
-        inline ~TSymmetricDifferenceImpl()
-        {
-            delete First_;
-            delete Second_;
+            return count;
         }
 
-        inline bool IsEmpty() const
+        IRangeImpl<TType>* FuseFilter(const IPredicate<TType>& predicate)
         {
-            return First_->IsEmpty() && Second_->IsEmpty();
+            Predicates_.push_back(predicate.Clone());
+            if (Cached_ && (*Predicates_.back())(Value_))
+            {
+                Range_->Pop();
+                Cached_ = false;
+            }
+            return this;
         }
 
-        inline void Pop()
+        bool Rewind(const IRangeImpl<TType>& source)
         {
-            ActiveRange_->Pop();
-            ActiveRange_ = Next();
+            const TFilteredTransformImpl& from =
+                static_cast<const TFilteredTransformImpl&>(source);
+            if (!RewindRange(Range_, *from.Range_))
+            {
+                return false;
+            }
+            Value_ = from.Value_;
+            Cached_ = from.Cached_;
+            return true;
         }
 
-        inline TType Front() const
+        inline IRangeImpl<TType>* Clone() const
         {
-            return ActiveRange_->Front();
+            return new TFilteredTransformImpl(this);
         }
-
-        IRangeImpl<TType>* Clone() const;
     };
 
-    template <class TType, class TCompare>
-    class TUniqueRangeImpl: public IRangeImpl<TType>
+    template <class TType, class TOldType, class TUnaryOp>
+    class TTransformedRangeImpl: public IRangeImpl<TType>
     {
-        IRangeImpl<TType>* const Range_;
-        TCompare Compare_;
+        IRangeImpl<TOldType>* Range_;
+        TUnaryOp Op_;
+        TFusedOps<TType, TOldType, TUnaryOp> Fused_;
+        TReadBlock<TOldType> Block_;
 
+    public:
         template <class TAssert>
-        TUniqueRangeImpl(TRange<TType, TAssert>& range, TCompare compare);
+        TTransformedRangeImpl(TRange<TOldType, TAssert>& range, TUnaryOp op);
 
-    public:
-        inline TUniqueRangeImpl(IRangeImpl<TType>* range, TCompare compare)
-            : Range_(range)
-            , Compare_(compare)
-        {
-        }
+        // Fuses op into transform of range with the same op type, if there
+        // is one on top of range
+        template <class TAssert>
+        static IRangeImpl<TType>* Create(TRange<TOldType, TAssert>& range,
+            TUnaryOp op);
 
-        inline ~TUniqueRangeImpl()
+        inline ~TTransformedRangeImpl()
         {
             delete Range_;
         }
@@ -586,80 +4238,89 @@ namespace NRaingee
 
         inline void Pop()
         {
-            TType val = Range_->Front();
-            do {
-                Range_->Pop();
-            } while (!Range_->IsEmpty() && Compare_(val, Range_->Front()));
+            Range_->Pop();
         }
 
         inline TType Front() const
         {
-            return Range_->Front();
+            return Fused_.Apply(Op_(Range_->Front()));
         }
 
-        IRangeImpl<TType>* Clone() const;
-    };
-
-    template <class TType, class TPredicate>
-    class TRemoveImpl: public IRangeImpl<TType>
-    {
-        IRangeImpl<TType>* const Range_;
-        TPredicate Predicate_;
-
-        void Next()
+        inline bool EstimateSize(std::size_t& size) const
         {
-            while (!Range_->IsEmpty() && Predicate_(Range_->Front()))
-            {
-                Range_->Pop();
-            }
+            return Range_->EstimateSize(size);
         }
 
-        template <class TAssert>
-        TRemoveImpl(TRange<TType, TAssert>& range, TPredicate predicate);
-
-    public:
-        inline TRemoveImpl(IRangeImpl<TType>* range, TPredicate predicate)
-            : Range_(range)
-            , Predicate_(predicate)
+        inline bool GetSize(std::size_t& size) const
         {
-            Next();
+            return Range_->GetSize(size);
         }
 
-        inline ~TRemoveImpl()
+        inline bool GetKnownSize(std::size_t& size) const
         {
-            delete Range_;
+            return Range_->GetKnownSize(size);
         }
 
-        inline bool IsEmpty() const
+        // Maps blocks of underlying range
+        std::size_t Read(TType* buffer, std::size_t size)
         {
-            return Range_->IsEmpty();
+            TOldType* block = Block_.Get();
+            std::size_t count = 0;
+            while (count < size)
+            {
+                std::size_t chunk = size - count;
+                if (chunk > TReadBlock<TOldType>::Size_)
+                {
+                    chunk = TReadBlock<TOldType>::Size_;
+                }
+                const std::size_t read = Range_->Read(block, chunk);
+                for (std::size_t i = 0; i < read; ++i)
+                {
+                    buffer[count++] = Fused_.Apply(Op_(block[i]));
+                }
+                if (read < chunk)
+                {
+                    break;
+                }
+            }
+            return count;
         }
 
-        inline void Pop()
+        // Passes underlying range to the filtered transform
+        IRangeImpl<TType>* FuseFilter(const IPredicate<TType>& predicate)
         {
-            Range_->Pop();
-            Next();
+            IRangeImpl<TType>* result =
+                new TFilteredTransformImpl<TType, TOldType, TUnaryOp>(Range_,
+                    Op_, Fused_, predicate);
+            Range_ = 0;
+            return result;
         }
 
-        inline TType Front() const
+        bool Rewind(const IRangeImpl<TType>& source)
         {
-            return Range_->Front();
+            const TTransformedRangeImpl& from =
+                static_cast<const TTransformedRangeImpl&>(source);
+            return RewindRange(Range_, *from.Range_);
         }
 
         IRangeImpl<TType>* Clone() const;
     };
 
+    // Invokes Op_ at most once per position, for expensive operations
     template <class TType, class TOldType, class TUnaryOp>
-    class TTransformedRangeImpl: public IRangeImpl<TType>
+    class TCachedTransformedRangeImpl: public IRangeImpl<TType>
     {
         IRangeImpl<TOldType>* const Range_;
         TUnaryOp Op_;
+        mutable TType Value_;
+        mutable bool Cached_;
 
     public:
         template <class TAssert>
-        TTransformedRangeImpl(TRange<TOldType, TAssert>& range, TUnaryOp op);
+        TCachedTransformedRangeImpl(TRange<TOldType, TAssert>& range,
+            TUnaryOp op);
 
-        inline ~TTransformedRangeImpl()
+        inline ~TCachedTransformedRangeImpl()
         {
             delete Range_;
         }
@@ -672,11 +4333,40 @@ namespace NRaingee
         inline void Pop()
         {
             Range_->Pop();
+            Cached_ = false;
         }
 
         inline TType Front() const
         {
-            return Op_(Range_->Front());
+            if (!Cached_)
+            {
+                Value_ = Op_(Range_->Front());
+                Cached_ = true;
+            }
+            return Value_;
+        }
+
+        inline bool EstimateSize(std::size_t& size) const
+        {
+            return Range_->EstimateSize(size);
+        }
+
+        inline bool GetSize(std::size_t& size) const
+        {
+            return Range_->GetSize(size);
+        }
+
+        inline bool GetKnownSize(std::size_t& size) const
+        {
+            return Range_->GetKnownSize(size);
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TCachedTransformedRangeImpl& from =
+                static_cast<const TCachedTransformedRangeImpl&>(source);
+            Cached_ = false;
+            return RewindRange(Range_, *from.Range_);
         }
 
         IRangeImpl<TType>* Clone() const;
@@ -717,9 +4407,139 @@ namespace NRaingee
             return Op_(First_->Front(), Second_->Front());
         }
 
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TTransformedRangesImpl& from =
+                static_cast<const TTransformedRangesImpl&>(source);
+            return RewindRange(First_, *from.First_)
+                && RewindRange(Second_, *from.Second_);
+        }
+
         IRangeImpl<TType>* Clone() const;
     };
 
+    // Applies op to elements at the same position of all ranges, until the
+    // shortest range ends. Ranges are pulled in blocks into columns, op is
+    // called with pointer to values of the row and their number.
+    template <class TType, class TOldType, class TOp>
+    class TZippedRangesImpl: public IRangeImpl<TType>
+    {
+        typedef std::vector<IRangeImpl<TOldType>*> TRanges_;
+
+        static const std::size_t BlockSize_ = 256;
+
+        TRanges_ Ranges_;
+        TOp Op_;
+        TOldType* const Columns_;
+        TOldType* const Row_;
+        std::size_t Position_;
+        std::size_t Size_;
+        TType Value_;
+
+        void Compute()
+        {
+            if (Position_ < Size_)
+            {
+                const std::size_t count = Ranges_.size();
+                for (std::size_t i = 0; i < count; ++i)
+                {
+                    Row_[i] = Columns_[i * BlockSize_ + Position_];
+                }
+                const TOldType* row = Row_;
+                Value_ = Op_(row, count);
+            }
+        }
+
+        void Fill()
+        {
+            Position_ = 0;
+            Size_ = BlockSize_;
+            for (std::size_t i = 0; i < Ranges_.size() && Size_; ++i)
+            {
+                Size_ = Ranges_[i]->Read(Columns_ + i * BlockSize_, Size_);
+            }
+            Compute();
+        }
+
+        explicit TZippedRangesImpl(const TZippedRangesImpl* range)
+            : Op_(range->Op_)
+            , Columns_(new TOldType[range->Ranges_.size() * BlockSize_])
+            , Row_(new TOldType[range->Ranges_.size()])
+            , Position_(range->Position_)
+            , Size_(range->Size_)
+            , Value_(range->Value_)
+        {
+            Ranges_.reserve(range->Ranges_.size());
+            for (std::size_t i = 0; i < range->Ranges_.size(); ++i)
+            {
+                Ranges_.push_back(range->Ranges_[i]->Clone());
+                std::copy(range->Columns_ + i * BlockSize_ + Position_,
+                    range->Columns_ + i * BlockSize_ + Size_,
+                    Columns_ + i * BlockSize_ + Position_);
+            }
+        }
+
+    public:
+        // Takes ownership of ranges, which must be non-empty
+        TZippedRangesImpl(const TRanges_& ranges, TOp op)
+            : Ranges_(ranges)
+            , Op_(op)
+            , Columns_(new TOldType[ranges.size() * BlockSize_])
+            , Row_(new TOldType[ranges.size()])
+            , Value_()
+        {
+            Fill();
+        }
+
+        ~TZippedRangesImpl()
+        {
+            for (std::size_t i = 0; i < Ranges_.size(); ++i)
+            {
+                delete Ranges_[i];
+            }
+            delete[] Columns_;
+            delete[] Row_;
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Position_ == Size_;
+        }
+
+        inline void Pop()
+        {
+            if (++Position_ == Size_ && Size_ == BlockSize_)
+            {
+                Fill();
+            }
+            else
+            {
+                Compute();
+            }
+        }
+
+        inline TType Front() const
+        {
+            return Value_;
+        }
+
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = 0;
+            for (; count < size && Position_ < Size_; ++count)
+            {
+                buffer[count] = Value_;
+                TZippedRangesImpl::Pop();
+            }
+            return count;
+        }
+
+        inline IRangeImpl<TType>* Clone() const
+        {
+            return new TZippedRangesImpl(this);
+        }
+    };
+
     template <class TType, class TInserter, class TDelimiter,
         class TEscapeChar, class TOldType>
     class TSplittedRangeImpl: public IRangeImpl<TType>
@@ -816,6 +4636,34 @@ namespace NRaingee
         }
     };
 
+#if __cplusplus >= 201103L
+    template <class TType>
+    static inline bool Assign(TType& to, const TType& from, std::true_type)
+    {
+        to = from;
+        return true;
+    }
+
+    template <class TType>
+    static inline bool Assign(TType&, const TType&, std::false_type)
+    {
+        return false;
+    }
+#endif
+
+    // Assigns value, unless its type is not copy assignable, like closure
+    // types are
+    template <class TType>
+    static inline bool Assign(TType& to, const TType& from)
+    {
+#if __cplusplus >= 201103L
+        return Assign(to, from, std::is_copy_assignable<TType>());
+#else
+        to = from;
+        return true;
+#endif
+    }
+
     template <class TType, class TGenerator, class TCounter>
     class TGeneratedRangeImpl: public IRangeImpl<TType>
     {
@@ -866,6 +4714,31 @@ namespace NRaingee
             return Value_;
         }
 
+        std::size_t Read(TType* buffer, std::size_t size)
+        {
+            std::size_t count = 0;
+            for (; count < size && !Empty_; ++count)
+            {
+                buffer[count] = Value_;
+                TGeneratedRangeImpl::Pop();
+            }
+            return count;
+        }
+
+        bool Rewind(const IRangeImpl<TType>& source)
+        {
+            const TGeneratedRangeImpl& from =
+                static_cast<const TGeneratedRangeImpl&>(source);
+            if (!Assign(Generator_, from.Generator_))
+            {
+                return false;
+            }
+            Counter_ = from.Counter_;
+            Value_ = from.Value_;
+            Empty_ = from.Empty_;
+            return true;
+        }
+
         inline IRangeImpl<TType>* Clone() const
         {
             return new TGeneratedRangeImpl(Value_, Generator_, Counter_);
@@ -0,0 +1,446 @@
+/*
+ * scored.hpp               -- ranking of scored ranges
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCORED_HPP_2026_10_18__
+#define __SCORED_HPP_2026_10_18__
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "compare.hpp"
+#include "range.hpp"
+
+namespace NRaingee
+{
+    // Orders (key, score) pairs by key only
+    template <class TKey, class TScore, class TCompare>
+    class TKeyOrder
+    {
+        TCompare Compare_;
+
+    public:
+        inline explicit TKeyOrder(const TCompare& compare)
+            : Compare_(compare)
+        {
+        }
+
+        inline bool operator ()(const std::pair<TKey, TScore>& lhs,
+            const std::pair<TKey, TScore>& rhs)
+        {
+            return TStrictWeakOrder<TCompare>::Less(Compare_, lhs.first,
+                rhs.first);
+        }
+    };
+
+    // Merges ranges of (key, score) pairs sorted by key, scores of equivalent
+    // keys are folded with combiner
+    template <class TKey, class TScore, class TCombiner, class TCompare>
+    class TScoredUnionImpl: public IRangeImpl<std::pair<TKey, TScore> >
+    {
+        typedef std::pair<TKey, TScore> TPair_;
+        typedef TKeyOrder<TKey, TScore, TCompare> TOrder_;
+        typedef std::vector<TRangeHead<TPair_>*> THeads_;
+
+        // Puts head with the least key on top of heap
+        class THeadGreater_
+        {
+            TOrder_ Order_;
+
+        public:
+            inline explicit THeadGreater_(const TOrder_& order)
+                : Order_(order)
+            {
+            }
+
+            inline bool operator ()(const TRangeHead<TPair_>* lhs,
+                const TRangeHead<TPair_>* rhs)
+            {
+                return Order_(rhs->Front(), lhs->Front());
+            }
+        };
+
+        THeads_ Heads_;
+        TCombiner Combiner_;
+        TOrder_ Order_;
+        TPair_ Front_;
+        bool Empty_;
+
+        void Advance()
+        {
+            std::pop_heap(Heads_.begin(), Heads_.end(), THeadGreater_(Order_));
+            TRangeHead<TPair_>* head = Heads_.back();
+            head->Pop();
+            if (head->IsEmpty())
+            {
+                delete head;
+                Heads_.pop_back();
+            }
+            else
+            {
+                std::push_heap(Heads_.begin(), Heads_.end(),
+                    THeadGreater_(Order_));
+            }
+        }
+
+        void Next()
+        {
+            Empty_ = Heads_.empty();
+            if (!Empty_)
+            {
+                Front_ = Heads_.front()->Front();
+                Advance();
+                while (!Heads_.empty()
+                    && !Order_(Front_, Heads_.front()->Front()))
+                {
+                    Front_.second = Combiner_(Front_.second,
+                        Heads_.front()->Front().second);
+                    Advance();
+                }
+            }
+        }
+
+        inline explicit TScoredUnionImpl(const TScoredUnionImpl* range)
+            : Combiner_(range->Combiner_)
+            , Order_(range->Order_)
+            , Front_(range->Front_)
+            , Empty_(range->Empty_)
+        {
+            Heads_.reserve(range->Heads_.size());
+            for (std::size_t i = 0; i < range->Heads_.size(); ++i)
+            {
+                Heads_.push_back(0);
+                Heads_.back() =
+                    new TRangeHead<TPair_>(range->Heads_[i]->Clone());
+            }
+        }
+
+    public:
+        template <class TInputIterator>
+        TScoredUnionImpl(TInputIterator first, TInputIterator last,
+            TCombiner combiner, TCompare compare)
+            : Combiner_(combiner)
+            , Order_(compare)
+            , Front_()
+            , Empty_(false)
+        {
+            for (; first != last; ++first)
+            {
+                if (!first->IsEmpty())
+                {
+                    typename std::iterator_traits<TInputIterator>::value_type
+                        range(*first);
+                    Heads_.push_back(0);
+                    Heads_.back() = new TRangeHead<TPair_>(range.Release());
+                }
+            }
+            std::make_heap(Heads_.begin(), Heads_.end(),
+                THeadGreater_(Order_));
+            Next();
+        }
+
+        inline ~TScoredUnionImpl()
+        {
+            for (std::size_t i = 0; i < Heads_.size(); ++i)
+            {
+                delete Heads_[i];
+            }
+        }
+
+        inline bool IsEmpty() const
+        {
+            return Empty_;
+        }
+
+        inline void Pop()
+        {
+            Next();
+        }
+
+        inline TPair_ Front() const
+        {
+            return Front_;
+        }
+
+        inline IRangeImpl<TPair_>* Clone() const
+        {
+            return new TScoredUnionImpl(this);
+        }
+    };
+
+    template <class TKey, class TScore>
+    struct TScoreGreater
+    {
+        inline bool operator ()(const std::pair<TKey, TScore>& lhs,
+            const std::pair<TKey, TScore>& rhs) const
+        {
+            return rhs.second < lhs.second;
+        }
+    };
+
+    // Bounded heap which keeps k pairs with the greatest scores
+    template <class TKey, class TScore>
+    class TTopK
+    {
+        typedef std::pair<TKey, TScore> TPair_;
+
+        std::vector<TPair_> Heap_;
+        const std::size_t K_;
+
+    public:
+        inline explicit TTopK(std::size_t k)
+            : K_(k)
+        {
+            Heap_.reserve(k);
+        }
+
+        inline bool IsFull() const
+        {
+            return Heap_.size() >= K_;
+        }
+
+        // Score which must be exceeded to get into full heap
+        inline const TScore& GetThreshold() const
+        {
+            return Heap_.front().second;
+        }
+
+        void Add(const TPair_& pair)
+        {
+            if (Heap_.size() < K_)
+            {
+                Heap_.push_back(pair);
+                std::push_heap(Heap_.begin(), Heap_.end(),
+                    TScoreGreater<TKey, TScore>());
+            }
+            else if (K_ && GetThreshold() < pair.second)
+            {
+                std::pop_heap(Heap_.begin(), Heap_.end(),
+                    TScoreGreater<TKey, TScore>());
+                Heap_.back() = pair;
+                std::push_heap(Heap_.begin(), Heap_.end(),
+                    TScoreGreater<TKey, TScore>());
+            }
+        }
+
+        // Moves pairs to result ordered by descending score
+        inline void Finish(std::vector<TPair_>& result)
+        {
+            std::sort_heap(Heap_.begin(), Heap_.end(),
+                TScoreGreater<TKey, TScore>());
+            result.swap(Heap_);
+        }
+    };
+
+    // MaxScore evaluation of top k keys over scored ranges. Ranges are
+    // ordered by their score bounds, and once the heap threshold exceeds
+    // combined bounds of the first ranges, they stop generating candidates
+    // and are only probed for keys found in the rest of ranges. Probing
+    // stops as soon as candidate can't get into heap.
+    template <class TKey, class TScore, class TCombiner, class TCompare>
+    class TMaxScoreTopK
+    {
+        typedef std::pair<TKey, TScore> TPair_;
+        typedef TRangeHead<TPair_> THead_;
+
+        std::vector<THead_*> Heads_;
+        std::vector<TScore> Bounds_;
+        TCombiner Combiner_;
+        TKeyOrder<TKey, TScore, TCompare> Order_;
+
+        TMaxScoreTopK(const TMaxScoreTopK&);
+        TMaxScoreTopK& operator =(const TMaxScoreTopK&);
+
+        // Pops the least key from essential ranges and folds its scores
+        TPair_ NextCandidate(std::size_t essential)
+        {
+            THead_* least = 0;
+            for (std::size_t i = essential; i < Heads_.size(); ++i)
+            {
+                if (!Heads_[i]->IsEmpty() && (!least
+                    || Order_(Heads_[i]->Front(), least->Front())))
+                {
+                    least = Heads_[i];
+                }
+            }
+            TPair_ candidate = least->Front();
+            least->Pop();
+            for (std::size_t i = essential; i < Heads_.size(); ++i)
+            {
+                if (Heads_[i] != least && !Heads_[i]->IsEmpty()
+                    && !Order_(candidate, Heads_[i]->Front()))
+                {
+                    candidate.second = Combiner_(candidate.second,
+                        Heads_[i]->Front().second);
+                    Heads_[i]->Pop();
+                }
+            }
+            return candidate;
+        }
+
+        bool HasCandidates(std::size_t essential) const
+        {
+            for (std::size_t i = essential; i < Heads_.size(); ++i)
+            {
+                if (!Heads_[i]->IsEmpty())
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        template <class TAssert>
+        TMaxScoreTopK(
+            const std::vector<TRange<TPair_, TAssert> >& ranges,
+            const std::vector<TScore>& maxScores, TCombiner combiner,
+            TCompare compare)
+            : Combiner_(combiner)
+            , Order_(compare)
+        {
+            std::vector<std::pair<TScore, std::size_t> > order;
+            for (std::size_t i = 0; i < ranges.size(); ++i)
+            {
+                if (!ranges[i].IsEmpty())
+                {
+                    order.push_back(std::make_pair(maxScores[i], i));
+                }
+            }
+            std::sort(order.begin(), order.end());
+            Heads_.reserve(order.size());
+            for (std::size_t i = 0; i < order.size(); ++i)
+            {
+                TRange<TPair_, TAssert> range(ranges[order[i].second]);
+                Heads_.push_back(0);
+                Heads_.back() = new THead_(range.Release());
+                Bounds_.push_back(i ?
+                    Combiner_(Bounds_.back(), order[i].first)
+                    : order[i].first);
+            }
+        }
+
+        inline ~TMaxScoreTopK()
+        {
+            for (std::size_t i = 0; i < Heads_.size(); ++i)
+            {
+                delete Heads_[i];
+            }
+        }
+
+        void Run(TTopK<TKey, TScore>& top)
+        {
+            std::size_t essential = 0;
+            while (HasCandidates(essential))
+            {
+                TPair_ candidate = NextCandidate(essential);
+                for (std::size_t i = essential; i--;)
+                {
+                    if (top.IsFull() && !(top.GetThreshold()
+                        < Combiner_(candidate.second, Bounds_[i])))
+                    {
+                        break;
+                    }
+                    Heads_[i]->SkipTo(candidate, Order_);
+                    if (!Heads_[i]->IsEmpty()
+                        && !Order_(candidate, Heads_[i]->Front()))
+                    {
+                        candidate.second = Combiner_(candidate.second,
+                            Heads_[i]->Front().second);
+                    }
+                }
+                top.Add(candidate);
+                while (top.IsFull() && essential < Heads_.size()
+                    && !(top.GetThreshold() < Bounds_[essential]))
+                {
+                    ++essential;
+                }
+            }
+        }
+    };
+
+    template <class TKey, class TScore, class TAssert, class TCombiner,
+        class TCompare>
+    static inline TRange<std::pair<TKey, TScore>, TAssert> ScoredUnion(
+        const std::vector<TRange<std::pair<TKey, TScore>, TAssert> >& ranges,
+        TCombiner combiner, TCompare compare)
+    {
+        return TRange<std::pair<TKey, TScore>, TAssert>(
+            new TScoredUnionImpl<TKey, TScore, TCombiner, TCompare>(
+                ranges.begin(), ranges.end(), combiner, compare));
+    }
+
+    // Sums scores of keys, ranges should be sorted by key
+    template <class TKey, class TScore, class TAssert>
+    static inline TRange<std::pair<TKey, TScore>, TAssert> ScoredUnion(
+        const std::vector<TRange<std::pair<TKey, TScore>, TAssert> >& ranges)
+    {
+        return ScoredUnion(ranges, std::plus<TScore>(), std::less<TKey>());
+    }
+
+    // Selects k pairs with the greatest scores, ordered by descending score
+    template <class TKey, class TScore, class TAssert>
+    static inline std::vector<std::pair<TKey, TScore> > TopK(
+        TRange<std::pair<TKey, TScore>, TAssert> range, std::size_t k)
+    {
+        TTopK<TKey, TScore> top(k);
+        for (; !range.IsEmpty(); range.Pop())
+        {
+            top.Add(range.Front());
+        }
+        std::vector<std::pair<TKey, TScore> > result;
+        top.Finish(result);
+        return result;
+    }
+
+    // Same as TopK(ScoredUnion(ranges, combiner, compare), k), but skips
+    // keys which can't get into result. maxScores holds upper bound of
+    // scores in each range, combiner must be monotone.
+    template <class TKey, class TScore, class TAssert, class TCombiner,
+        class TCompare>
+    static inline std::vector<std::pair<TKey, TScore> > TopK(
+        const std::vector<TRange<std::pair<TKey, TScore>, TAssert> >& ranges,
+        const std::vector<TScore>& maxScores, std::size_t k,
+        TCombiner combiner, TCompare compare)
+    {
+        TTopK<TKey, TScore> top(k);
+        if (k)
+        {
+            TMaxScoreTopK<TKey, TScore, TCombiner, TCompare>(ranges,
+                maxScores, combiner, compare).Run(top);
+        }
+        std::vector<std::pair<TKey, TScore> > result;
+        top.Finish(result);
+        return result;
+    }
+
+    // Sums scores of keys, ranges should be sorted by key
+    template <class TKey, class TScore, class TAssert>
+    static inline std::vector<std::pair<TKey, TScore> > TopK(
+        const std::vector<TRange<std::pair<TKey, TScore>, TAssert> >& ranges,
+        const std::vector<TScore>& maxScores, std::size_t k)
+    {
+        return TopK(ranges, maxScores, k, std::plus<TScore>(),
+            std::less<TKey>());
+    }
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * sketch.hpp               -- cardinality sketches
+ *
+ * Copyright (C) 2012 Dmitry Potapov <potapov.d@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SKETCH_HPP_2026_10_18__
+#define __SKETCH_HPP_2026_10_18__
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include "hash.hpp"
+
+namespace NRaingee
+{
+    // HyperLogLog with 2^12 one byte registers, standard error is about
+    // 1.6%. Hashes must be uniformly distributed over 64 bits.
+    class THyperLogLog
+    {
+        static const unsigned Precision_ = 12;
+
+        std::vector<unsigned char> Registers_;
+
+    public:
+        inline THyperLogLog()
+            : Registers_(1 << Precision_)
+        {
+        }
+
+        inline void Add(TFingerprint hash)
+        {
+            unsigned char& reg = Registers_[hash >> (64 - Precision_)];
+            TFingerprint rest = hash << Precision_;
+            unsigned char rank = 1;
+            for (; rank <= 64 - Precision_ && !(rest >> 63); rest <<= 1)
+            {
+                ++rank;
+            }
+            reg = std::max(reg, rank);
+        }
+
+        inline void Merge(const THyperLogLog& sketch)
+        {
+            // Registers never exceed 127, so eight of them are compared at
+            // once: high bit of (lhs | 0x80) - rhs is set where lhs >= rhs
+            const unsigned long long high = 0x8080808080808080ULL;
+            for (std::size_t i = 0; i < Registers_.size(); i += 8)
+            {
+                unsigned long long lhs;
+                unsigned long long rhs;
+                std::memcpy(&lhs, &Registers_[i], 8);
+                std::memcpy(&rhs, &sketch.Registers_[i], 8);
+                const unsigned long long mask =
+                    ((((lhs | high) - rhs) & high) >> 7) * 0xff;
+                lhs = (lhs & mask) | (rhs & ~mask);
+                std::memcpy(&Registers_[i], &lhs, 8);
+            }
+        }
+
+        double Estimate() const
+        {
+            const double size = Registers_.size();
+            double sum = 0;
+            std::size_t zeros = 0;
+            for (std::size_t i = 0; i < Registers_.size(); ++i)
+            {
+                sum += std::ldexp(1., -Registers_[i]);
+                zeros += !Registers_[i];
+            }
+            const double estimate =
+                0.7213 / (1 + 1.079 / size) * size * size / sum;
+            if (estimate <= 2.5 * size && zeros)
+            {
+                // Linear counting is more accurate for small sets
+                return size * std::log(size / zeros);
+            }
+            return estimate;
+        }
+    };
+
+    // K minimum values sketch, keeps 256 least distinct hashes of the set.
+    // Unlike HyperLogLog it can tell which of sampled hashes are shared
+    // between sets, which gives resemblance of sets.
+    class TMinValues
+    {
+        static const std::size_t Size_ = 256;
+
+        std::vector<TFingerprint> Values_;
+
+    public:
+        inline void Add(TFingerprint hash)
+        {
+            if (Values_.size() < Size_ || hash < Values_.back())
+            {
+                std::vector<TFingerprint>::iterator iter =
+                    std::lower_bound(Values_.begin(), Values_.end(), hash);
+                if (iter == Values_.end() || *iter != hash)
+                {
+                    Values_.insert(iter, hash);
+                    if (Values_.size() > Size_)
+                    {
+                        Values_.pop_back();
+                    }
+                }
+            }
+        }
+
+        inline void Merge(const TMinValues& sketch)
+        {
+            if (sketch.Values_.empty() || (Values_.size() == Size_
+                && !(sketch.Values_.front() < Values_.back())))
+            {
+                return;
+            }
+            std::vector<TFingerprint> values;
+            values.reserve(Values_.size() + sketch.Values_.size());
+            std::set_union(Values_.begin(), Values_.end(),
+                sketch.Values_.begin(), sketch.Values_.end(),
+                std::back_inserter(values));
+            if (values.size() > Size_)
+            {
+                values.resize(Size_);
+            }
+            Values_.swap(values);
+        }
+
+        // Set size is known exactly while it fits into sketch
+        inline bool IsExact() const
+        {
+            return Values_.size() < Size_;
+        }
+
+        inline bool Contains(TFingerprint hash) const
+        {
+            return std::binary_search(Values_.begin(), Values_.end(), hash);
+        }
+
+        inline const std::vector<TFingerprint>& GetValues() const
+        {
+            return Values_;
+        }
+    };
+
+    // Sketch of set of hashes which estimates sizes of sets unions and
+    // intersections without accessing the sets
+    class TSketch
+    {
+        THyperLogLog HyperLogLog_;
+        TMinValues MinValues_;
+
+    public:
+        inline void Add(TFingerprint hash)
+        {
+            HyperLogLog_.Add(hash);
+            MinValues_.Add(hash);
+        }
+
+        // Makes sketch of sets union
+        inline void Merge(const TSketch& sketch)
+        {
+            HyperLogLog_.Merge(sketch.HyperLogLog_);
+            MinValues_.Merge(sketch.MinValues_);
+        }
+
+        inline double EstimateSize() const
+        {
+            if (MinValues_.IsExact())
+            {
+                return MinValues_.GetValues().size();
+            }
+            else
+            {
+                return HyperLogLog_.Estimate();
+            }
+        }
+
+        inline const TMinValues& GetMinValues() const
+        {
+            return MinValues_;
+        }
+    };
+
+    // Size of intersection of sets is size of their union multiplied by
+    // fraction of union sample found in every set
+    static inline double EstimateIntersectionSize(
+        const std::vector<TSketch>& sketches)
+    {
+        if (sketches.empty())
+        {
+            return 0;
+        }
+        TSketch united;
+        for (std::size_t i = 0; i < sketches.size(); ++i)
+        {
+            united.Merge(sketches[i]);
+        }
+        const std::vector<TFingerprint>& sample =
+            united.GetMinValues().GetValues();
+        if (sample.empty())
+        {
+            return 0;
+        }
+        std::size_t common = 0;
+        for (std::size_t i = 0; i < sample.size(); ++i)
+        {
+            std::size_t j = 0;
+            while (j < sketches.size()
+                && sketches[j].GetMinValues().Contains(sample[i]))
+            {
+                ++j;
+            }
+            common += j == sketches.size();
+        }
+        return united.EstimateSize() * common / sample.size();
+    }
+}
+
+#endif